@@ -0,0 +1,65 @@
+#include "cache.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+std::string GetCacheDirectory() {
+    const char* cache = getenv("XDG_CACHE_HOME");
+    if (cache && cache[0] == '/')
+        return std::string{ cache };
+    const char* home = getenv("HOME");
+    if (home && home[0])
+        return std::string{ home } + "/.cache";
+    return std::string{};
+}
+
+bool MakeDirectories(const std::string& path) {
+    for (size_t i = 1; i <= path.size(); ++i) {
+        if (i < path.size() && path[i] != '/')
+            continue;
+        std::string parent = path.substr(0, i);
+        if (mkdir(parent.c_str(), 0700) != 0 && errno != EEXIST)
+            return false;
+    }
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool WriteFileAtomic(const std::string& path, const void* data, size_t size) {
+    std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return false;
+
+    const char* bytes = (const char*)data;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t count = write(fd, bytes + written, size - written);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            break;
+        written += (size_t)count;
+    }
+
+    if (close(fd) != 0 || written != size || rename(temporary.c_str(), path.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+uint64_t HashBytes(const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
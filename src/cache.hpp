@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+
+//Per user cache directory, $XDG_CACHE_HOME or ~/.cache. Empty when neither is set.
+std::string GetCacheDirectory();
+
+//Create a directory and its parents, true when it exists afterwards.
+bool MakeDirectories(const std::string& path);
+
+//Write to a temporary file renamed over path, readers never see half a file.
+bool WriteFileAtomic(const std::string& path, const void* data, size_t size);
+
+//64 bit FNV-1a of some bytes, for naming cache entries.
+uint64_t HashBytes(const void* data, size_t size);
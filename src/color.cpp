@@ -0,0 +1,206 @@
+#include "color.hpp"
+#include "color_kernels.hpp"
+
+#include <memory>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+typedef float Float4 __attribute__((vector_size(16)));
+typedef int32_t Int4 __attribute__((vector_size(16)));
+
+//Compile time conversions have to land on the OkLab of white and on the sRGB they started from.
+static_assert(lain::cx::Abs(ColorTo<Lab>(RGB{ 1.0f, 1.0f, 1.0f }).L - 1.0) < 1e-4);
+static_assert(lain::cx::Abs(ColorTo<RGB>(ColorTo<Lab>(RGB{ 0.2f, 0.5f, 0.8f })).g - 0.5) < 1e-5);
+
+//A kernel whose cube root doesn't hold up on the edge cases is passed over for the next narrower one.
+ColorKernel GetBestColorKernel() {
+#ifdef LAIN_COLOR_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && CbrtKernelIsExactAVX512())
+        return ColorKernel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && CbrtKernelIsExactAVX2())
+        return ColorKernel::AVX2;
+#endif
+    if (CbrtKernelIsExact<Float4, Int4>())
+        return ColorKernel::SSE2;
+    return ColorKernel::Scalar;
+}
+
+static ColorKernel colorKernel = GetBestColorKernel();
+
+void SetColorKernel(ColorKernel kernel) {
+    colorKernel = std::min(kernel, GetBestColorKernel());
+}
+
+ColorKernel GetColorKernel() {
+    return colorKernel;
+}
+
+void LinearPlanesToLab(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B) {
+    size_t i = 0;
+#ifdef LAIN_COLOR_DISPATCH
+    if (colorKernel == ColorKernel::AVX512)
+        i = LinearPlanesToLabAVX512(r, g, b, count, L, A, B);
+    else if (colorKernel == ColorKernel::AVX2)
+        i = LinearPlanesToLabAVX2(r, g, b, count, L, A, B);
+#endif
+    //What is left of the wide kernels goes 4 at a time, then one by one.
+    if (colorKernel != ColorKernel::Scalar)
+        i += LinearPlanesToLabKernel<Float4, Int4>(r + i, g + i, b + i, count - i, L + i, A + i, B + i);
+    for (; i < count; ++i) {
+        Lab color = LinearRGBToLab(r[i], g[i], b[i]);
+        L[i] = color.L;
+        A[i] = color.a;
+        B[i] = color.b;
+    }
+}
+
+void GammaToLinearPlane(const float* src, size_t count, float* dst) {
+    size_t i = 0;
+#ifdef LAIN_COLOR_DISPATCH
+    if (colorKernel == ColorKernel::AVX512)
+        i = GammaToLinearAVX512(src, count, dst);
+    else if (colorKernel == ColorKernel::AVX2)
+        i = GammaToLinearAVX2(src, count, dst);
+#endif
+    if (colorKernel != ColorKernel::Scalar)
+        i += GammaToLinearKernel<Float4, Int4>(src + i, count - i, dst + i);
+    for (; i < count; ++i)
+        dst[i] = GammaToLinear(src[i]);
+}
+
+void LinearToGammaPlane(const float* src, size_t count, float* dst) {
+    size_t i = 0;
+#ifdef LAIN_COLOR_DISPATCH
+    if (colorKernel == ColorKernel::AVX512)
+        i = LinearToGammaAVX512(src, count, dst);
+    else if (colorKernel == ColorKernel::AVX2)
+        i = LinearToGammaAVX2(src, count, dst);
+#endif
+    if (colorKernel != ColorKernel::Scalar)
+        i += LinearToGammaKernel<Float4, Int4>(src + i, count - i, dst + i);
+    for (; i < count; ++i)
+        dst[i] = LinearToGamma(src[i]);
+}
+
+void LabPlanesToLinear(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b) {
+    size_t i = 0;
+#ifdef LAIN_COLOR_DISPATCH
+    if (colorKernel == ColorKernel::AVX512)
+        i = LabPlanesToLinearAVX512(L, A, B, count, r, g, b);
+    else if (colorKernel == ColorKernel::AVX2)
+        i = LabPlanesToLinearAVX2(L, A, B, count, r, g, b);
+#endif
+    if (colorKernel != ColorKernel::Scalar)
+        i += LabPlanesToLinearKernel<Float4, Int4>(L + i, A + i, B + i, count - i, r + i, g + i, b + i);
+    for (; i < count; ++i) {
+        RGB color = LabToLinearRGB(Lab{ L[i], A[i], B[i] });
+        r[i] = color.r;
+        g[i] = color.g;
+        b[i] = color.b;
+    }
+}
+
+void LabPlanesToRGB(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b) {
+    LabPlanesToLinear(L, A, B, count, r, g, b);
+    for (float* plane : { r, g, b }) {
+        LinearToGammaPlane(plane, count, plane);
+        for (size_t i = 0; i < count; ++i)
+            plane[i] = std::clamp(plane[i], 0.0f, 1.0f);
+    }
+}
+
+LabLUT::LabLUT(uint32_t size) : size(std::clamp(size, 2u, 256u)) {
+    //Points are evenly spaced in the cube root of linear light, the curve OkLab bends colors with, not in sRGB codes.
+    //Spaced by code, the cells next to black span most of the range of L and interpolating them is off by 0.04.
+    const float* toLinear = GetSRGB8ToLinearTable();
+    for (uint32_t i = 0; i < 256; ++i) {
+        float position = cbrtf(toLinear[i]) * (float)(this->size - 1);
+        offsets[i] = std::min((uint32_t)position, this->size - 2);
+        weights[i] = position - (float)offsets[i];
+    }
+
+    //One run of blue per red and green, converted in bulk.
+    std::vector<float> linear(this->size), red(this->size), green(this->size), L(this->size), a(this->size), b(this->size);
+    for (uint32_t i = 0; i < this->size; ++i) {
+        float root = (float)i / (float)(this->size - 1);
+        linear[i] = root * root * root;
+    }
+
+    lattice.resize((size_t)this->size * this->size * this->size * 4);
+    for (uint32_t r = 0; r < this->size; ++r) {
+        for (uint32_t g = 0; g < this->size; ++g) {
+            std::fill(red.begin(), red.end(), linear[r]);
+            std::fill(green.begin(), green.end(), linear[g]);
+            LinearPlanesToLab(red.data(), green.data(), linear.data(), this->size, L.data(), a.data(), b.data());
+            float* point = &lattice[((size_t)r * this->size + g) * this->size * 4];
+            for (uint32_t i = 0; i < this->size; ++i, point += 4) {
+                point[0] = L[i];
+                point[1] = a[i];
+                point[2] = b[i];
+            }
+        }
+    }
+}
+
+//Blend the 8 points of the cell starting at point, weights along red, green and blue.
+static inline Lab Trilinear(const float* point, size_t greenStride, size_t redStride, float wr, float wg, float wb) {
+#ifdef __SSE2__
+    auto lerp = [](__m128 x, __m128 y, __m128 t) { return _mm_add_ps(x, _mm_mul_ps(_mm_sub_ps(y, x), t)); };
+    const float* next = point + redStride;
+    __m128 tb = _mm_set1_ps(wb);
+    __m128 c00 = lerp(_mm_loadu_ps(point), _mm_loadu_ps(point + 4), tb);
+    __m128 c01 = lerp(_mm_loadu_ps(point + greenStride), _mm_loadu_ps(point + greenStride + 4), tb);
+    __m128 c10 = lerp(_mm_loadu_ps(next), _mm_loadu_ps(next + 4), tb);
+    __m128 c11 = lerp(_mm_loadu_ps(next + greenStride), _mm_loadu_ps(next + greenStride + 4), tb);
+    __m128 tg = _mm_set1_ps(wg);
+    __m128 c = lerp(lerp(c00, c01, tg), lerp(c10, c11, tg), _mm_set1_ps(wr));
+    alignas(16) float result[4];
+    _mm_store_ps(result, c);
+    return Lab{ result[0], result[1], result[2] };
+#else
+    float result[3];
+    for (int i = 0; i < 3; ++i) {
+        const float* p = point + i;
+        const float* q = p + redStride;
+        float c0 = std::lerp(std::lerp(p[0], p[4], wb), std::lerp(p[greenStride], p[greenStride + 4], wb), wg);
+        float c1 = std::lerp(std::lerp(q[0], q[4], wb), std::lerp(q[greenStride], q[greenStride + 4], wb), wg);
+        result[i] = std::lerp(c0, c1, wr);
+    }
+    return Lab{ result[0], result[1], result[2] };
+#endif
+}
+
+Lab LabLUT::Lookup(RGB8 color) const {
+    size_t greenStride = (size_t)size * 4;
+    size_t redStride = greenStride * size;
+    const float* point = &lattice[offsets[color.r] * redStride + offsets[color.g] * greenStride + offsets[color.b] * 4];
+    return Trilinear(point, greenStride, redStride, weights[color.r], weights[color.g], weights[color.b]);
+}
+
+void LabLUT::RowToLab(const unsigned char* src, size_t count, size_t channels, bool bgr, float* L, float* a, float* b) const {
+    int red = bgr ? 2 : 0;
+    int blue = bgr ? 0 : 2;
+    for (size_t i = 0; i < count; ++i, src += channels) {
+        Lab color = Lookup(RGB8{ src[red], src[1], src[blue] });
+        L[i] = color.L;
+        a[i] = color.a;
+        b[i] = color.b;
+    }
+}
+
+static std::unique_ptr<LabLUT> labLUT{};
+
+void SetLabLUTSize(uint32_t size) {
+    if (size == 0)
+        labLUT.reset();
+    else if (!labLUT || labLUT->GetSize() != size)
+        labLUT = std::make_unique<LabLUT>(size);
+}
+
+const LabLUT* GetLabLUT() {
+    return labLUT.get();
+}
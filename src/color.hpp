@@ -2,7 +2,12 @@
 
 #include <cstdio>
 #include <cmath>
+#include <cstdint>
+#include <array>
+#include <vector>
+#include <algorithm>
 #include <iostream>
+#include "color_cx.hpp"
 
 
 struct RGB {
@@ -11,6 +16,13 @@ struct RGB {
     float b;
 };
 
+//8 bit sRGB pixel, the codes as they are in the file.
+struct RGB8 {
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+};
+
 struct Lab {
     float L;
     float a;
@@ -23,6 +35,75 @@ struct LCh {
     float h;
 };
 
+//Structure of arrays storage for OkLab pixels, one plane per channel.
+struct LabPlanes {
+    std::vector<float> L{};
+    std::vector<float> a{};
+    std::vector<float> b{};
+
+    inline void Resize(size_t size) {
+        L.resize(size);
+        a.resize(size);
+        b.resize(size);
+    }
+
+    inline size_t Size() const { return L.size(); }
+};
+
+//OkLab in 16 bit fixed point, 2^14 steps per unit on every channel so distances stay isotropic.
+//6 bytes instead of 12 for quantizing large sample sets, steps of 6e-5 are far below what anyone can see.
+//Channels are clamped to +-16383, squared distances between two of them always fit in 32 bits unsigned.
+struct Lab16 {
+    int16_t L;
+    int16_t a;
+    int16_t b;
+};
+
+constexpr float Lab16Scale = 16384.0f;
+
+constexpr int16_t ToFixed16(float x) {
+    float scaled = std::clamp(x * Lab16Scale, -16383.0f, 16383.0f);
+    return (int16_t)(scaled < 0.0f ? scaled - 0.5f : scaled + 0.5f);
+}
+
+constexpr Lab16 ToLab16(Lab color) {
+    return Lab16{ ToFixed16(color.L), ToFixed16(color.a), ToFixed16(color.b) };
+}
+
+constexpr Lab FromLab16(Lab16 color) {
+    return Lab{ color.L / Lab16Scale, color.a / Lab16Scale, color.b / Lab16Scale };
+}
+
+//Lab16 of count samples that convert(first, count, L, a, b) writes as float planes, a chunk at a time
+//so the float planes of all of them are never held.
+template<typename Convert>
+inline void ConvertToLab16(size_t count, Lab16* dst, Convert convert) {
+    constexpr size_t chunk = 4096;
+    LabPlanes planes{};
+    planes.Resize(std::min(count, chunk));
+    for (size_t first = 0; first < count; first += chunk) {
+        size_t n = std::min(chunk, count - first);
+        convert(first, n, planes.L.data(), planes.a.data(), planes.b.data());
+        for (size_t i = 0; i < n; ++i)
+            dst[first + i] = ToLab16(Lab{ planes.L[i], planes.a[i], planes.b[i] });
+    }
+}
+
+//Squared distance between two fixed point colors, in fixed point units squared.
+constexpr uint32_t GetDistance16(Lab16 x, Lab16 y) {
+    int32_t dL = x.L - y.L;
+    int32_t da = x.a - y.a;
+    int32_t db = x.b - y.b;
+    return (uint32_t)(dL * dL) + (uint32_t)(da * da) + (uint32_t)(db * db);
+}
+
+//One color of a paletted image and how many pixels use it.
+struct PaletteEntry {
+    RGB rgb;
+    Lab lab;
+    uint64_t count;
+};
+
 inline void PrintRGB(RGB color) {
     fprintf(stdout, "\x1b[48;2;%d;%d;%dm \033[0m", (int)(color.r * 255.0f), (int)(color.g * 255.0f), (int)(color.b * 255.0f));
     fprintf(stdout, "\x1b[48;2;%d;%d;%dm \033[0m", (int)(color.r * 255.0f), (int)(color.g * 255.0f), (int)(color.b * 255.0f));
@@ -49,42 +130,110 @@ inline std::string RGB2String(RGB color) {
 }
 
 //https://bottosson.github.io/posts/colorwrong
-inline float LinearToGamma(float x)
+//Like every conversion below, constant expressions go through lain::cx instead of libm and fold at compile time.
+constexpr float LinearToGamma(float x)
 {
     if (x >= 0.0031308f)
-        return (1.055f) * powf(x, (1.0f/2.4f)) - 0.055f;
+        return (1.055f) * lain::cx::Powf(x, (1.0f/2.4f)) - 0.055f;
     else
         return 12.92f * x;
 }
 
 //https://bottosson.github.io/posts/colorwrong
-inline float GammaToLinear(float x)
+constexpr float GammaToLinear(float x)
 {
     if (x >= 0.04045f)
-        return powf((x + 0.055f)/(1.0f + 0.055f), 2.4f);
+        return lain::cx::Powf((x + 0.055f)/(1.0f + 0.055f), 2.4f);
     else 
         return x / 12.92f;
 }
 
-template<typename T, typename U>
-inline T ColorTo(U color) {
-    return T{};
+//Instruction sets the batch conversions below can run with, picked at startup from what the cpu has.
+//Everything but Scalar approximates cbrtf and powf, within 1e-6 of them.
+enum class ColorKernel {
+    Scalar, //libm cbrtf and powf, exactly what ColorTo does.
+    SSE2, //4 floats at a time, whatever 128 bit vectors the target has outside of x86.
+    AVX2, //8 floats at a time with fma.
+    AVX512 //16 floats at a time.
+};
+
+//Widest ColorKernel the cpu supports.
+ColorKernel GetBestColorKernel();
+
+//Switch the batch conversions to kernel, or the best supported one when the cpu lacks it. Call before any thread converts.
+void SetColorKernel(ColorKernel kernel);
+ColorKernel GetColorKernel();
+
+//OkLab of count linear sRGB colors given as planes, with the ColorKernel in use. In color.cpp.
+void LinearPlanesToLab(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B);
+
+//GammaToLinear and LinearToGamma of count values with the ColorKernel in use, src and dst can be the same.
+void GammaToLinearPlane(const float* src, size_t count, float* dst);
+void LinearToGammaPlane(const float* src, size_t count, float* dst);
+
+//Linear sRGB of count OkLab colors given as planes, unclamped, with the ColorKernel in use.
+void LabPlanesToLinear(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b);
+
+//ColorTo<RGB, Lab> of count colors into planes, gamma encoded and clamped to [0, 1].
+void LabPlanesToRGB(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b);
+
+//Linear value of every 8 bit sRGB code, built once on first use.
+inline const float* GetSRGB8ToLinearTable() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(256);
+        for (uint32_t i = 0; i < 256; ++i)
+            t[i] = (float)i / 255.0f;
+        GammaToLinearPlane(t.data(), t.size(), t.data());
+        return t;
+    }();
+    return table.data();
 }
 
-//https://bottosson.github.io/posts/oklab/
-template<>
-inline Lab ColorTo<Lab, RGB>(RGB color) {
-    float r = GammaToLinear(color.r);
-    float g = GammaToLinear(color.g);
-    float b = GammaToLinear(color.b);
+//Linear value of every 16 bit sRGB code, built once on first use.
+inline const float* GetSRGB16ToLinearTable() {
+    static const std::vector<float> table = [] {
+        std::vector<float> t(65536);
+        for (uint32_t i = 0; i < 65536; ++i)
+            t[i] = (float)i / 65535.0f;
+        GammaToLinearPlane(t.data(), t.size(), t.data());
+        return t;
+    }();
+    return table.data();
+}
 
-    float l = 0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b;
-	float m = 0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b;
-	float s = 0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b;
+//Linear value of every 8 bit sRGB code in 14 bit fixed point, four of them still add up in 16 bits. Built once on first use.
+inline const uint16_t* GetSRGB8ToLinear14Table() {
+    static const std::vector<uint16_t> table = [] {
+        const float* linear = GetSRGB8ToLinearTable();
+        std::vector<uint16_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i)
+            t[i] = (uint16_t)lroundf(linear[i] * 16383.0f);
+        return t;
+    }();
+    return table.data();
+}
+
+//8 bit sRGB code of every 14 bit linear value, the way back from GetSRGB8ToLinear14Table. Built once on first use.
+inline const unsigned char* GetLinear14ToSRGB8Table() {
+    static const std::vector<unsigned char> table = [] {
+        std::vector<float> gamma(16384);
+        for (uint32_t i = 0; i < 16384; ++i)
+            gamma[i] = (float)i / 16383.0f;
+        LinearToGammaPlane(gamma.data(), gamma.size(), gamma.data());
+        std::vector<unsigned char> t(16384);
+        for (uint32_t i = 0; i < 16384; ++i)
+            t[i] = (unsigned char)lroundf(gamma[i] * 255.0f);
+        return t;
+    }();
+    return table.data();
+}
 
-    float l_ = cbrtf(l);
-    float m_ = cbrtf(m);
-    float s_ = cbrtf(s);
+//https://bottosson.github.io/posts/oklab/
+//OkLab of a linear sRGB color, what ColorTo<Lab, RGB> does after the gamma decode.
+constexpr Lab LinearRGBToLab(float r, float g, float b) {
+    float l_ = lain::cx::Cbrtf(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float m_ = lain::cx::Cbrtf(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float s_ = lain::cx::Cbrtf(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
 
     return {
         0.2104542553f*l_ + 0.7936177850f*m_ - 0.0040720468f*s_,
@@ -93,9 +242,61 @@ inline Lab ColorTo<Lab, RGB>(RGB color) {
     };
 }
 
+template<typename T, typename U>
+constexpr T ColorTo(U color) {
+    return T{};
+}
+
 //https://bottosson.github.io/posts/oklab/
 template<>
-inline RGB ColorTo<RGB, Lab>(Lab color) {
+constexpr Lab ColorTo<Lab, RGB>(RGB color) {
+    return LinearRGBToLab(GammaToLinear(color.r), GammaToLinear(color.g), GammaToLinear(color.b));
+}
+
+//OkLab of the 8 bit sRGB cube sampled at size points per side, looked up with trilinear interpolation.
+//Worst OkLab distance to the exact conversion over all 2^24 colors, for a few sizes:
+//  17: 5.9e-3 (0.08MB)  33: 1.6e-3 (0.6MB)  65: 4.7e-4 (4.4MB)  129: 1.3e-4 (34MB)  256: 2.6e-5 (268MB)
+//The worst colors are all near black. A just noticeable difference is around 2e-2, any size is below it.
+class LabLUT {
+public:
+    explicit LabLUT(uint32_t size);
+
+    inline uint32_t GetSize() const { return size; }
+
+    Lab Lookup(RGB8 color) const;
+
+    //Same as RGB8RowToLab, with blue first in memory when bgr is set.
+    void RowToLab(const unsigned char* src, size_t count, size_t channels, bool bgr, float* L, float* a, float* b) const;
+
+private:
+    uint32_t size;
+    std::vector<float> lattice{}; //L, a, b and a padding float per point, red major.
+    std::array<uint32_t, 256> offsets{}; //Lattice point below each code along an axis, in points.
+    std::array<float, 256> weights{}; //How far each code is past that point.
+};
+
+//Convert 8 bit sRGB with a LabLUT of this size from now on, 0 goes back to the exact conversion.
+//The lattice is built right away, call this before any thread converts pixels. In color.cpp.
+void SetLabLUTSize(uint32_t size);
+
+//The LabLUT 8 bit sRGB goes through, nullptr for the exact conversion.
+const LabLUT* GetLabLUT();
+
+//8 bit codes have 256 possible values, the gamma decode is a table lookup instead of a powf per channel.
+template<>
+constexpr Lab ColorTo<Lab, RGB8>(RGB8 color) {
+    if (!std::is_constant_evaluated()) {
+        if (const LabLUT* lut = GetLabLUT())
+            return lut->Lookup(color);
+        const float* linear = GetSRGB8ToLinearTable();
+        return LinearRGBToLab(linear[color.r], linear[color.g], linear[color.b]);
+    }
+    return LinearRGBToLab(GammaToLinear(color.r / 255.0f), GammaToLinear(color.g / 255.0f), GammaToLinear(color.b / 255.0f));
+}
+
+//https://bottosson.github.io/posts/oklab/
+//Linear sRGB of an OkLab color, what ColorTo<RGB, Lab> does before the gamma encode.
+constexpr RGB LabToLinearRGB(Lab color) {
     float l_ = color.L + 0.3963377774f * color.a + 0.2158037573f * color.b;
     float m_ = color.L - 0.1055613458f * color.a - 0.0638541728f * color.b;
     float s_ = color.L - 0.0894841775f * color.a - 1.2914855480f * color.b;
@@ -104,13 +305,20 @@ inline RGB ColorTo<RGB, Lab>(Lab color) {
     float m = m_*m_*m_;
     float s = s_*s_*s_;
 
-	float r = +4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
-	float g = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
-	float b = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+    return {
+        +4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s,
+        -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s,
+        -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s,
+    };
+}
 
-    r = LinearToGamma(r);
-    g = LinearToGamma(g);
-    b = LinearToGamma(b);
+//https://bottosson.github.io/posts/oklab/
+template<>
+constexpr RGB ColorTo<RGB, Lab>(Lab color) {
+    RGB linear = LabToLinearRGB(color);
+    float r = LinearToGamma(linear.r);
+    float g = LinearToGamma(linear.g);
+    float b = LinearToGamma(linear.b);
 
     r = r > 1.0f ? 1.0f : r < 0.0f ? 0.0f : r;
     g = g > 1.0f ? 1.0f : g < 0.0f ? 0.0f : g;
@@ -119,40 +327,137 @@ inline RGB ColorTo<RGB, Lab>(Lab color) {
     return RGB{ r, g, b };
 }
 
+//Gather count pixels, step elements apart, through toLinear(pixel, r, g, b) into linear planes
+//a chunk at a time and convert each chunk in one LinearPlanesToLab pass.
+template<typename T, typename ToLinear>
+inline void PixelsToLab(const T* src, size_t count, size_t step, float* L, float* a, float* b, ToLinear toLinear) {
+    const size_t chunk = 256;
+    float red[chunk], green[chunk], blue[chunk];
+
+    for (size_t start = 0; start < count; start += chunk) {
+        size_t n = std::min(count - start, chunk);
+        for (size_t i = 0; i < n; ++i, src += step)
+            toLinear(src, red[i], green[i], blue[i]);
+        LinearPlanesToLab(red, green, blue, n, L + start, a + start, b + start);
+    }
+}
+
+//Convert count RGB8 pixels, channels bytes apart, straight to OkLab planes.
+//Same math as ColorTo<Lab, RGB> with the gamma decode replaced by a table lookup, or the LabLUT when one is set.
+//A multiple of the pixel size as channels picks every n-th pixel.
+inline void RGB8RowToLab(const unsigned char* src, size_t count, size_t channels, float* L, float* a, float* b) {
+    if (const LabLUT* lut = GetLabLUT()) {
+        lut->RowToLab(src, count, channels, false, L, a, b);
+        return;
+    }
+    const float* toLinear = GetSRGB8ToLinearTable();
+    PixelsToLab(src, count, channels, L, a, b, [toLinear](const unsigned char* p, float& r, float& g, float& b) {
+        r = toLinear[p[0]];
+        g = toLinear[p[1]];
+        b = toLinear[p[2]];
+    });
+}
+
+//8 bit sRGB of a JPEG YCbCr pixel, in the fixed point stb_image converts with so both give the same codes.
+constexpr RGB8 YCbCrToRGB8(unsigned char y, unsigned char cb, unsigned char cr) {
+    int32_t base = (y << 20) + (1 << 19);
+    int32_t crOffset = cr - 128;
+    int32_t cbOffset = cb - 128;
+    int32_t r = (base + crOffset * (5743 << 8)) >> 20;
+    int32_t g = (base + crOffset * -(2925 << 8) + (int32_t)((uint32_t)(cbOffset * -(1410 << 8)) & 0xffff0000u)) >> 20;
+    int32_t b = (base + cbOffset * (7258 << 8)) >> 20;
+    return RGB8{ (unsigned char)std::clamp(r, 0, 255), (unsigned char)std::clamp(g, 0, 255), (unsigned char)std::clamp(b, 0, 255) };
+}
+
+//OkLab of a row of JPEG YCbCr pixels given as planes. The color conversion and gamma decode are fused into
+//the bulk OkLab conversion a chunk at a time, no RGB8 row is written. Same result as RGB8RowToLab on the
+//row stb_image would have converted.
+inline void YCbCrRowToLab(const unsigned char* y, const unsigned char* cb, const unsigned char* cr, size_t count, float* L, float* a, float* b) {
+    const size_t chunk = 256;
+    if (const LabLUT* lut = GetLabLUT()) {
+        //The lattice is indexed by codes, they only live for a chunk.
+        unsigned char codes[chunk * 3];
+        for (size_t start = 0; start < count; start += chunk) {
+            size_t n = std::min(count - start, chunk);
+            for (size_t i = 0; i < n; ++i) {
+                RGB8 color = YCbCrToRGB8(y[start + i], cb[start + i], cr[start + i]);
+                codes[i * 3] = color.r;
+                codes[i * 3 + 1] = color.g;
+                codes[i * 3 + 2] = color.b;
+            }
+            lut->RowToLab(codes, n, 3, false, L + start, a + start, b + start);
+        }
+        return;
+    }
+
+    const float* toLinear = GetSRGB8ToLinearTable();
+    float red[chunk], green[chunk], blue[chunk];
+    for (size_t start = 0; start < count; start += chunk) {
+        size_t n = std::min(count - start, chunk);
+        for (size_t i = 0; i < n; ++i) {
+            RGB8 color = YCbCrToRGB8(y[start + i], cb[start + i], cr[start + i]);
+            red[i] = toLinear[color.r];
+            green[i] = toLinear[color.g];
+            blue[i] = toLinear[color.b];
+        }
+        LinearPlanesToLab(red, green, blue, n, L + start, a + start, b + start);
+    }
+}
+
+//Same as RGB8RowToLab for 16 bit sRGB, through the 65536 entry table.
+inline void RGB16RowToLab(const uint16_t* src, size_t count, size_t channels, float* L, float* a, float* b) {
+    const float* toLinear = GetSRGB16ToLinearTable();
+    PixelsToLab(src, count, channels, L, a, b, [toLinear](const uint16_t* p, float& r, float& g, float& b) {
+        r = toLinear[p[0]];
+        g = toLinear[p[1]];
+        b = toLinear[p[2]];
+    });
+}
+
+//Linear float pixels (hdr) have no gamma to undo and go straight to the LMS matrix.
+//They are clamped to the displayable [0, 1] range first, like every other source.
+inline void LinearRowToLab(const float* src, size_t count, size_t channels, float* L, float* a, float* b) {
+    PixelsToLab(src, count, channels, L, a, b, [](const float* p, float& r, float& g, float& b) {
+        r = std::clamp(p[0], 0.0f, 1.0f);
+        g = std::clamp(p[1], 0.0f, 1.0f);
+        b = std::clamp(p[2], 0.0f, 1.0f);
+    });
+}
+
 template<>
-inline LCh ColorTo<LCh, Lab>(Lab color) {
+constexpr LCh ColorTo<LCh, Lab>(Lab color) {
     return {
         color.L,
-        sqrtf(color.a * color.a + color.b * color.b),
-        atan2f(color.b, color.a)
+        lain::cx::Sqrtf(color.a * color.a + color.b * color.b),
+        lain::cx::Atan2f(color.b, color.a)
     };
 }
 
 template<>
-inline Lab ColorTo<Lab, LCh>(LCh color) {
+constexpr Lab ColorTo<Lab, LCh>(LCh color) {
     return {
         color.L,
-        color.C * cosf(color.h),
-        color.C * sinf(color.h)
+        color.C * lain::cx::Cosf(color.h),
+        color.C * lain::cx::Sinf(color.h)
     };
 }
 
 template<>
-inline LCh ColorTo<LCh, RGB>(RGB color) {
+constexpr LCh ColorTo<LCh, RGB>(RGB color) {
     return ColorTo<LCh>(ColorTo<Lab>(color));
 }
 
 template<>
-inline RGB ColorTo<RGB, LCh>(LCh color) {
+constexpr RGB ColorTo<RGB, LCh>(LCh color) {
     return ColorTo<RGB>(ColorTo<Lab>(color));
 }
 
-inline LCh LerpLCh(LCh a, LCh b, float t) {
-    float x = std::lerp(cosf(a.h), cosf(b.h), t);
-    float y = std::lerp(sinf(a.h), sinf(b.h), t);
+constexpr LCh LerpLCh(LCh a, LCh b, float t) {
+    float x = std::lerp(lain::cx::Cosf(a.h), lain::cx::Cosf(b.h), t);
+    float y = std::lerp(lain::cx::Sinf(a.h), lain::cx::Sinf(b.h), t);
     return LCh{
         std::lerp(a.L, b.L, t),
         std::lerp(a.C, b.C, t),
-        atan2f(y, x)
+        lain::cx::Atan2f(y, x)
     };
 }
\ No newline at end of file
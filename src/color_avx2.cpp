@@ -0,0 +1,25 @@
+#include "color_kernels.hpp"
+
+typedef float Float8 __attribute__((vector_size(32)));
+typedef int32_t Int8 __attribute__((vector_size(32)));
+
+
+size_t LinearPlanesToLabAVX2(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B) {
+    return LinearPlanesToLabKernel<Float8, Int8>(r, g, b, count, L, A, B);
+}
+
+size_t LabPlanesToLinearAVX2(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b) {
+    return LabPlanesToLinearKernel<Float8, Int8>(L, A, B, count, r, g, b);
+}
+
+size_t GammaToLinearAVX2(const float* src, size_t count, float* dst) {
+    return GammaToLinearKernel<Float8, Int8>(src, count, dst);
+}
+
+size_t LinearToGammaAVX2(const float* src, size_t count, float* dst) {
+    return LinearToGammaKernel<Float8, Int8>(src, count, dst);
+}
+
+bool CbrtKernelIsExactAVX2() {
+    return CbrtKernelIsExact<Float8, Int8>();
+}
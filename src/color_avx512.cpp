@@ -0,0 +1,25 @@
+#include "color_kernels.hpp"
+
+typedef float Float16 __attribute__((vector_size(64)));
+typedef int32_t Int16 __attribute__((vector_size(64)));
+
+
+size_t LinearPlanesToLabAVX512(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B) {
+    return LinearPlanesToLabKernel<Float16, Int16>(r, g, b, count, L, A, B);
+}
+
+size_t LabPlanesToLinearAVX512(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b) {
+    return LabPlanesToLinearKernel<Float16, Int16>(L, A, B, count, r, g, b);
+}
+
+size_t GammaToLinearAVX512(const float* src, size_t count, float* dst) {
+    return GammaToLinearKernel<Float16, Int16>(src, count, dst);
+}
+
+size_t LinearToGammaAVX512(const float* src, size_t count, float* dst) {
+    return LinearToGammaKernel<Float16, Int16>(src, count, dst);
+}
+
+bool CbrtKernelIsExactAVX512() {
+    return CbrtKernelIsExact<Float16, Int16>();
+}
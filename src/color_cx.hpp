@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+
+
+//Compile time versions of the libm functions the color conversions use, so colors can be folded by the
+//compiler. They work in double and round once to float: within an ulp of glibc cbrtf and atan2f, and the
+//same as powf on every 8 and 14 bit sRGB code. Too slow to call at run time,
+//the float versions at the end pick libm outside of constant expressions.
+namespace lain::cx {
+
+constexpr double Pi = 3.14159265358979323846;
+constexpr double Ln2 = 0.69314718055994530942;
+
+constexpr double Abs(double x) {
+    return x < 0.0 ? -x : x;
+}
+
+constexpr double Sqrt(double x) {
+    if (x <= 0.0)
+        return 0.0;
+    double y = x > 1.0 ? x : 1.0;
+    for (int i = 0; i < 100; ++i) {
+        double next = 0.5 * (y + x / y);
+        if (next >= y)
+            break;
+        y = next;
+    }
+    return y;
+}
+
+constexpr double Cbrt(double x) {
+    if (x == 0.0)
+        return 0.0;
+    if (x < 0.0)
+        return -Cbrt(-x);
+
+    //Bring x into [1, 8) where a Newton step from 1.5 converges quickly, the cube root scales by 2.
+    double scale = 1.0;
+    while (x >= 8.0) {
+        x *= 0.125;
+        scale *= 2.0;
+    }
+    while (x < 1.0) {
+        x *= 8.0;
+        scale *= 0.5;
+    }
+    double y = 1.5;
+    for (int i = 0; i < 8; ++i)
+        y -= (y * y * y - x) / (3.0 * y * y);
+    return y * scale;
+}
+
+//Natural log of positive x, from x = m 2^e and log(m) = 2 atanh((m - 1) / (m + 1)).
+constexpr double Log(double x) {
+    int exponent = 0;
+    while (x >= 2.0) {
+        x *= 0.5;
+        ++exponent;
+    }
+    while (x < 1.0) {
+        x *= 2.0;
+        --exponent;
+    }
+    double t = (x - 1.0) / (x + 1.0);
+    double t2 = t * t;
+    double term = t;
+    double sum = 0.0;
+    for (int i = 1; i < 60 && term / i + sum != sum; i += 2) {
+        sum += term / i;
+        term *= t2;
+    }
+    return 2.0 * sum + exponent * Ln2;
+}
+
+//e^x as 2^k e^r with |r| <= ln(2) / 2, the series of e^r converges in a few terms.
+constexpr double Exp(double x) {
+    double k = (double)(int64_t)(x / Ln2 + (x < 0.0 ? -0.5 : 0.5));
+    double r = x - k * Ln2;
+    double term = 1.0;
+    double sum = 1.0;
+    for (int i = 1; i < 30 && sum + term != sum; ++i) {
+        term *= r / i;
+        sum += term;
+    }
+    for (; k > 0.0; --k)
+        sum *= 2.0;
+    for (; k < 0.0; ++k)
+        sum *= 0.5;
+    return sum;
+}
+
+constexpr double Pow(double x, double p) {
+    return x <= 0.0 ? 0.0 : Exp(p * Log(x));
+}
+
+//Sine and cosine of x brought back into [-pi, pi].
+constexpr double Sin(double x) {
+    x -= 2.0 * Pi * (double)(int64_t)(x / (2.0 * Pi));
+    if (x > Pi)
+        x -= 2.0 * Pi;
+    else if (x < -Pi)
+        x += 2.0 * Pi;
+    double term = x;
+    double sum = x;
+    for (int i = 1; i < 30; ++i) {
+        term *= -x * x / ((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+constexpr double Cos(double x) {
+    return Sin(x + Pi / 2.0);
+}
+
+//Arc tangent of x, halved twice with atan(x) = 2 atan(x / (1 + sqrt(1 + x^2))) so the series is short.
+constexpr double Atan(double x) {
+    if (x < 0.0)
+        return -Atan(-x);
+    if (x > 1.0)
+        return Pi / 2.0 - Atan(1.0 / x);
+    for (int i = 0; i < 2; ++i)
+        x = x / (1.0 + Sqrt(1.0 + x * x));
+    double term = x;
+    double sum = 0.0;
+    for (int i = 1; i < 60; i += 2) {
+        sum += term / i;
+        term *= -x * x;
+    }
+    return 4.0 * sum;
+}
+
+constexpr double Atan2(double y, double x) {
+    if (x > 0.0)
+        return Atan(y / x);
+    if (x < 0.0)
+        return y >= 0.0 ? Atan(y / x) + Pi : Atan(y / x) - Pi;
+    return y > 0.0 ? Pi / 2.0 : y < 0.0 ? -Pi / 2.0 : 0.0;
+}
+
+//Nearest integer, halfway cases away from zero like lroundf.
+constexpr long Round(double x) {
+    return x < 0.0 ? -(long)(-x + 0.5) : (long)(x + 0.5);
+}
+
+//What the color conversions call in place of libm.
+constexpr float Powf(float x, float p) {
+    return std::is_constant_evaluated() ? (float)Pow(x, p) : powf(x, p);
+}
+
+constexpr float Cbrtf(float x) {
+    return std::is_constant_evaluated() ? (float)Cbrt(x) : cbrtf(x);
+}
+
+constexpr float Sqrtf(float x) {
+    return std::is_constant_evaluated() ? (float)Sqrt(x) : sqrtf(x);
+}
+
+constexpr float Sinf(float x) {
+    return std::is_constant_evaluated() ? (float)Sin(x) : sinf(x);
+}
+
+constexpr float Cosf(float x) {
+    return std::is_constant_evaluated() ? (float)Cos(x) : cosf(x);
+}
+
+constexpr float Atan2f(float y, float x) {
+    return std::is_constant_evaluated() ? (float)Atan2(y, x) : atan2f(y, x);
+}
+
+}
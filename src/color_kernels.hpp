@@ -0,0 +1,193 @@
+#pragma once
+
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+
+//Color conversion kernels written once against GCC vector extensions and compiled for each instruction set
+//by the file that includes them: color.cpp for 4 floats, color_avx2.cpp for 8, color_avx512.cpp for 16.
+//F is a vector of floats and I the vector of ints of the same size. Everything here is in an anonymous namespace
+//and calls nothing from other headers, code built with -mavx2 must not be shared with the other files.
+
+namespace {
+
+template<typename F, typename I>
+inline F LoadVector(const float* p) {
+    F v;
+    __builtin_memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template<typename F, typename I>
+inline void StoreVector(float* p, F v) {
+    __builtin_memcpy(p, &v, sizeof(v));
+}
+
+template<typename F, typename I>
+inline F Select(I mask, F a, F b) {
+    return (F)(((I)a & mask) | ((I)b & ~mask));
+}
+
+//Cube root of non negative floats. The exponent divided by 3 is a guess within a few percent,
+//two Halley steps y * (y^3 + 2x) / (2y^3 + x) take it to float precision. (within 1e-6 of cbrtf)
+//The steps are 0 / 0 for 0 and lose the denormals, anything up to FLT_MIN gives 0, which is within 1e-12 of cbrtf.
+template<typename F, typename I>
+inline F CbrtKernel(F x) {
+    I bits = __builtin_convertvector(__builtin_convertvector((I)x, F) * (1.0f / 3.0f), I);
+    F y = (F)(bits + 0x2a514067);
+
+    F twoX = x + x;
+    for (int i = 0; i < 2; ++i) {
+        F y3 = y * y * y;
+        y = y * (y3 + twoX) / (y3 + y3 + x);
+    }
+    return Select<F, I>(x > FLT_MIN, y, F{});
+}
+
+//CbrtKernel within 1e-6 of cbrtf for 0, the smallest denormal, FLT_MIN and 1, the inputs the Halley steps
+//get wrong when the edge cases break. Checked before a kernel is picked. Lanes past the first four repeat them.
+template<typename F, typename I>
+inline bool CbrtKernelIsExact() {
+    const float inputs[4] = { 0.0f, FLT_TRUE_MIN, FLT_MIN, 1.0f };
+    const float expected[4] = { 0.0f, 1.1212e-15f, 2.2737e-13f, 1.0f };
+    float lanes[sizeof(F) / sizeof(float)];
+    for (size_t i = 0; i < sizeof(F) / sizeof(float); ++i)
+        lanes[i] = inputs[i % 4];
+    StoreVector<F, I>(lanes, CbrtKernel<F, I>(LoadVector<F, I>(lanes)));
+    for (size_t i = 0; i < sizeof(F) / sizeof(float); ++i) {
+        float error = lanes[i] - expected[i % 4];
+        if (!(error < 1e-6f && error > -1e-6f))
+            return false;
+    }
+    return true;
+}
+
+//x^p for positive x as 2^(p log2(x)), both through minimax polynomials. (relative error around 1e-6)
+template<typename F, typename I>
+inline F PowKernel(F x, float p) {
+    //x = m 2^e with m in [sqrt(1/2), sqrt(2)), log2(m) = d poly(d) with d = m - 1.
+    I bits = (I)x;
+    I e = ((bits >> 23) & 255) - 127;
+    F m = (F)((bits & 0x7fffff) | 0x3f800000);
+    I high = m > 1.41421356f;
+    m = Select<F, I>(high, m * 0.5f, m);
+    e -= high;
+    F d = m - 1.0f;
+    F poly = d * -0.142759734f + 0.232652579f;
+    poly = poly * d - 0.249271822f;
+    poly = poly * d + 0.287288882f;
+    poly = poly * d - 0.360225182f;
+    poly = poly * d + 0.480916708f;
+    poly = poly * d - 0.721352931f;
+    poly = poly * d + 1.44269499f;
+    F y = (__builtin_convertvector(e, F) + d * poly) * p;
+
+    //2^y = 2^n 2^f with n the nearest integer and f in [-0.5, 0.5].
+    y = Select<F, I>(y < -126.0f, F{} - 126.0f, Select<F, I>(y > 127.0f, F{} + 127.0f, y));
+    F shifted = y + 0.5f;
+    I n = __builtin_convertvector(shifted, I);
+    n += __builtin_convertvector(n, F) > shifted; //Truncation rounds negatives up, true is -1.
+    F f = y - __builtin_convertvector(n, F);
+    F power = f * 0.00133908634f + 0.00967603192f;
+    power = power * f + 0.0555035711f;
+    power = power * f + 0.240221075f;
+    power = power * f + 0.693147188f;
+    power = power * f + 1.00000008f;
+    return power * (F)((n + 127) << 23);
+}
+
+//Row of a 3x3 matrix times three vectors.
+template<typename F>
+inline F Dot3(float m0, float m1, float m2, F x, F y, F z) {
+    return m0 * x + m1 * y + m2 * z;
+}
+
+//Same as LinearPlanesToLab for as many whole vectors as fit in count, returns how many colors were done.
+template<typename F, typename I>
+size_t LinearPlanesToLabKernel(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B) {
+    const size_t width = sizeof(F) / sizeof(float);
+    size_t i = 0;
+    for (; i + width <= count; i += width) {
+        F red = LoadVector<F, I>(r + i);
+        F green = LoadVector<F, I>(g + i);
+        F blue = LoadVector<F, I>(b + i);
+
+        F l_ = CbrtKernel<F, I>(Dot3(0.4122214708f, 0.5363325363f, 0.0514459929f, red, green, blue));
+        F m_ = CbrtKernel<F, I>(Dot3(0.2119034982f, 0.6806995451f, 0.1073969566f, red, green, blue));
+        F s_ = CbrtKernel<F, I>(Dot3(0.0883024619f, 0.2817188376f, 0.6299787005f, red, green, blue));
+
+        StoreVector<F, I>(L + i, Dot3(0.2104542553f, 0.7936177850f, -0.0040720468f, l_, m_, s_));
+        StoreVector<F, I>(A + i, Dot3(1.9779984951f, -2.4285922050f, 0.4505937099f, l_, m_, s_));
+        StoreVector<F, I>(B + i, Dot3(0.0259040371f, 0.7827717662f, -0.8086757660f, l_, m_, s_));
+    }
+    return i;
+}
+
+//Linear sRGB of OkLab planes, what ColorTo<RGB, Lab> does before the gamma encode, for whole vectors.
+//Returns how many colors were done.
+template<typename F, typename I>
+size_t LabPlanesToLinearKernel(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b) {
+    const size_t width = sizeof(F) / sizeof(float);
+    size_t i = 0;
+    for (; i + width <= count; i += width) {
+        F lightness = LoadVector<F, I>(L + i);
+        F greenRed = LoadVector<F, I>(A + i);
+        F blueYellow = LoadVector<F, I>(B + i);
+
+        F l_ = Dot3(1.0f, 0.3963377774f, 0.2158037573f, lightness, greenRed, blueYellow);
+        F m_ = Dot3(1.0f, -0.1055613458f, -0.0638541728f, lightness, greenRed, blueYellow);
+        F s_ = Dot3(1.0f, -0.0894841775f, -1.2914855480f, lightness, greenRed, blueYellow);
+        F l = l_ * l_ * l_;
+        F m = m_ * m_ * m_;
+        F s = s_ * s_ * s_;
+
+        StoreVector<F, I>(r + i, Dot3(4.0767416621f, -3.3077115913f, 0.2309699292f, l, m, s));
+        StoreVector<F, I>(g + i, Dot3(-1.2684380046f, 2.6097574011f, -0.3413193965f, l, m, s));
+        StoreVector<F, I>(b + i, Dot3(-0.0041960863f, -0.7034186147f, 1.7076147010f, l, m, s));
+    }
+    return i;
+}
+
+//Same as GammaToLinearPlane for whole vectors, returns how many values were done.
+template<typename F, typename I>
+size_t GammaToLinearKernel(const float* src, size_t count, float* dst) {
+    const size_t width = sizeof(F) / sizeof(float);
+    size_t i = 0;
+    for (; i + width <= count; i += width) {
+        F x = LoadVector<F, I>(src + i);
+        F curve = PowKernel<F, I>((x + 0.055f) * (1.0f / 1.055f), 2.4f);
+        StoreVector<F, I>(dst + i, Select<F, I>(x >= 0.04045f, curve, x * (1.0f / 12.92f)));
+    }
+    return i;
+}
+
+//Same as LinearToGammaPlane for whole vectors, returns how many values were done.
+template<typename F, typename I>
+size_t LinearToGammaKernel(const float* src, size_t count, float* dst) {
+    const size_t width = sizeof(F) / sizeof(float);
+    size_t i = 0;
+    for (; i + width <= count; i += width) {
+        F x = LoadVector<F, I>(src + i);
+        //The linear segment covers x <= 0, the power only ever sees positive values.
+        F positive = Select<F, I>(x >= 0.0031308f, x, F{} + 1.0f);
+        F curve = 1.055f * PowKernel<F, I>(positive, 1.0f / 2.4f) - 0.055f;
+        StoreVector<F, I>(dst + i, Select<F, I>(x >= 0.0031308f, curve, 12.92f * x));
+    }
+    return i;
+}
+
+}
+
+#ifdef LAIN_COLOR_DISPATCH
+//Built with -mavx2 -mfma in color_avx2.cpp and -mavx512f in color_avx512.cpp, only call them when the cpu has those.
+size_t LinearPlanesToLabAVX2(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B);
+size_t LabPlanesToLinearAVX2(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b);
+size_t GammaToLinearAVX2(const float* src, size_t count, float* dst);
+size_t LinearToGammaAVX2(const float* src, size_t count, float* dst);
+bool CbrtKernelIsExactAVX2();
+size_t LinearPlanesToLabAVX512(const float* r, const float* g, const float* b, size_t count, float* L, float* A, float* B);
+size_t LabPlanesToLinearAVX512(const float* L, const float* A, const float* B, size_t count, float* r, float* g, float* b);
+size_t GammaToLinearAVX512(const float* src, size_t count, float* dst);
+size_t LinearToGammaAVX512(const float* src, size_t count, float* dst);
+bool CbrtKernelIsExactAVX512();
+#endif
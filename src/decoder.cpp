@@ -0,0 +1,346 @@
+#include "decoder.hpp"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NATIVE_DECODER_SSSE3
+#endif
+
+
+//Same limit stb puts on either side.
+static const uint32_t MaxDimension = 1 << 24;
+//The QOI spec caps images at 400 million pixels.
+static const uint64_t MaxQOIPixels = 400000000;
+
+static uint32_t ReadBE32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+#ifdef NATIVE_DECODER_SSSE3
+//Shuffle as many whole steps as fit in 16 byte loads and stores, returns the pixels done.
+__attribute__((target("ssse3")))
+static int ShuffleSSSE3(const unsigned char* src, unsigned char* dst, int count, int inBytes, int outBytes, int step, const unsigned char* mask) {
+    __m128i shuffle = _mm_loadu_si128((const __m128i*)mask);
+    int i = 0;
+    //Each step reads and writes 16 bytes but only moves step pixels, stop while both still fit in the row.
+    while ((count - i) * inBytes >= 16 && (count - i) * outBytes >= 16) {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(src + (size_t)i * inBytes));
+        _mm_storeu_si128((__m128i*)(dst + (size_t)i * outBytes), _mm_shuffle_epi8(pixels, shuffle));
+        i += step;
+    }
+    return i;
+}
+
+static bool HasSSSE3() {
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+#endif
+
+NativeDecoder::NativeDecoder(const unsigned char* data, size_t size) : data(data), size(size) {
+    if (ReadQOI() || ReadFarbfeld() || ReadPNM()) {
+        SetLayout();
+        return;
+    }
+    width = 0;
+    height = 0;
+    format = Format::None;
+}
+
+bool NativeDecoder::ReadQOI() {
+    //Header, then at least the 8 byte end marker.
+    if (size < 22 || memcmp(data, "qoif", 4) != 0)
+        return false;
+    uint32_t w = ReadBE32(data + 4);
+    uint32_t h = ReadBE32(data + 8);
+    channels = data[12];
+    if (w == 0 || h == 0 || w > MaxDimension || h > MaxDimension || (channels != 3 && channels != 4))
+        return false;
+    //A byte of ops covers at most a run of 62 pixels, anything claiming more is a lie
+    //that would only make us allocate rows for nothing.
+    uint64_t pixelCount = (uint64_t)w * h;
+    if (pixelCount > MaxQOIPixels || pixelCount > (uint64_t)(size - 22) * 62)
+        return false;
+
+    format = Format::QOI;
+    width = (int)w;
+    height = (int)h;
+    offset = 14;
+    return true;
+}
+
+bool NativeDecoder::ReadFarbfeld() {
+    if (size < 16 || memcmp(data, "farbfeld", 8) != 0)
+        return false;
+    uint32_t w = ReadBE32(data + 8);
+    uint32_t h = ReadBE32(data + 12);
+    if (w == 0 || h == 0 || w > MaxDimension || h > MaxDimension || (size - 16) / 8 / w < h)
+        return false;
+
+    format = Format::Farbfeld;
+    width = (int)w;
+    height = (int)h;
+    channels = 4;
+    depth = 16;
+    maxValue = 65535;
+    offset = 16;
+    return true;
+}
+
+//Skip whitespace and comments between the fields of a PNM header.
+static void SkipPNMSpace(const unsigned char*& p, const unsigned char* end) {
+    while (p < end) {
+        if (*p == '#') {
+            while (p < end && *p != '\n' && *p != '\r')
+                ++p;
+        } else if (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r' || *p == '\v' || *p == '\f') {
+            ++p;
+        } else {
+            break;
+        }
+    }
+}
+
+static bool ReadPNMNumber(const unsigned char*& p, const unsigned char* end, uint32_t& value) {
+    SkipPNMSpace(p, end);
+    if (p == end || *p < '0' || *p > '9')
+        return false;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p++ - '0');
+        if (value > MaxDimension)
+            return false;
+    }
+    return true;
+}
+
+bool NativeDecoder::ReadPNM() {
+    if (size < 3 || data[0] != 'P' || (data[1] != '5' && data[1] != '6' && data[1] != '7'))
+        return false;
+
+    const unsigned char* p = data + 2;
+    const unsigned char* end = data + size;
+    uint32_t w = 0, h = 0, d = 0, max = 0;
+
+    if (data[1] == '7') {
+        //PAM header, one keyword and its value per line up to ENDHDR.
+        while (true) {
+            SkipPNMSpace(p, end);
+            const unsigned char* word = p;
+            while (p < end && ((*p >= 'A' && *p <= 'Z') || *p == '_'))
+                ++p;
+            size_t length = p - word;
+            if (length == 6 && memcmp(word, "ENDHDR", 6) == 0)
+                break;
+            if (length == 8 && memcmp(word, "TUPLTYPE", 8) == 0) {
+                //Only DEPTH says how many samples there are.
+                while (p < end && *p != '\n')
+                    ++p;
+                continue;
+            }
+            uint32_t* field = nullptr;
+            if (length == 5 && memcmp(word, "WIDTH", 5) == 0)
+                field = &w;
+            else if (length == 6 && memcmp(word, "HEIGHT", 6) == 0)
+                field = &h;
+            else if (length == 5 && memcmp(word, "DEPTH", 5) == 0)
+                field = &d;
+            else if (length == 6 && memcmp(word, "MAXVAL", 6) == 0)
+                field = &max;
+            if (!field || !ReadPNMNumber(p, end, *field))
+                return false;
+        }
+        //ENDHDR ends its line, the pixels start on the next.
+        while (p < end && *p != '\n')
+            ++p;
+        if (p == end)
+            return false;
+        ++p;
+        if (d < 1 || d > 4)
+            return false;
+    } else {
+        if (!ReadPNMNumber(p, end, w) || !ReadPNMNumber(p, end, h) || !ReadPNMNumber(p, end, max))
+            return false;
+        //A single whitespace byte separates the header from the pixels.
+        if (p == end)
+            return false;
+        ++p;
+        d = data[1] == '5' ? 1 : 3;
+    }
+
+    if (w == 0 || h == 0 || max == 0 || max > 65535)
+        return false;
+    int bytes = max > 255 ? 2 : 1;
+    if ((size_t)(end - p) / ((size_t)d * bytes) / w < h)
+        return false;
+
+    format = Format::PNM;
+    width = (int)w;
+    height = (int)h;
+    channels = (int)d;
+    depth = bytes * 8;
+    maxValue = max;
+    offset = p - data;
+    return true;
+}
+
+void NativeDecoder::SetLayout() {
+    layout = Layout{};
+    if (format == Format::QOI)
+        return;
+
+    int bytes = depth / 8;
+    layout.inBytes = channels * bytes;
+    layout.outBytes = 3 * bytes;
+    //Gray fills all three channels, alpha is dropped. 16 bit samples are big endian in the
+    //file, the maps swap them to the little endian hosts lain builds for.
+    static const unsigned char gray8[3] = { 0, 0, 0 };
+    static const unsigned char rgb8[3] = { 0, 1, 2 };
+    static const unsigned char gray16[6] = { 1, 0, 1, 0, 1, 0 };
+    static const unsigned char rgb16[6] = { 1, 0, 3, 2, 5, 4 };
+    const unsigned char* map = bytes == 1 ? (channels < 3 ? gray8 : rgb8) : (channels < 3 ? gray16 : rgb16);
+    memcpy(layout.map, map, layout.outBytes);
+
+    layout.step = std::min(16 / layout.inBytes, 16 / layout.outBytes);
+    memset(layout.mask, 0x80, sizeof(layout.mask));
+    for (int i = 0; i < layout.step; ++i)
+        for (int j = 0; j < layout.outBytes; ++j)
+            layout.mask[i * layout.outBytes + j] = (unsigned char)(i * layout.inBytes + layout.map[j]);
+}
+
+void NativeDecoder::ShuffleRow(const unsigned char* src, unsigned char* dst) const {
+    int i = 0;
+#ifdef NATIVE_DECODER_SSSE3
+    if (HasSSSE3())
+        i = ShuffleSSSE3(src, dst, width, layout.inBytes, layout.outBytes, layout.step, layout.mask);
+#endif
+    for (; i < width; ++i) {
+        const unsigned char* in = src + (size_t)i * layout.inBytes;
+        unsigned char* out = dst + (size_t)i * layout.outBytes;
+        for (int j = 0; j < layout.outBytes; ++j)
+            out[j] = in[layout.map[j]];
+    }
+}
+
+void NativeDecoder::ScaleRow16(uint16_t* row) const {
+    //Samples over the max value are broken files, they saturate.
+    for (size_t i = 0; i < (size_t)width * 3; ++i)
+        row[i] = row[i] >= maxValue ? 65535 : (uint16_t)(((uint32_t)row[i] * 65535 + maxValue / 2) / maxValue);
+}
+
+bool NativeDecoder::DecodeRows(RowCallback callback, void* user) const {
+    if (!IsValid())
+        return false;
+    if (format == Format::QOI)
+        return DecodeQOI(callback, user);
+
+    size_t rowBytes = (size_t)width * layout.inBytes;
+    std::vector<unsigned char> row((size_t)width * 3);
+
+    if (depth == 16) {
+        std::vector<uint16_t> wide((size_t)width * 3);
+        for (int y = 0; y < height; ++y) {
+            ShuffleRow(data + offset + rowBytes * y, (unsigned char*)wide.data());
+            if (maxValue != 65535)
+                ScaleRow16(wide.data());
+            for (size_t i = 0; i < row.size(); ++i)
+                row[i] = (unsigned char)(wide[i] >> 8);
+            callback(user, row.data(), y, width, height, 3);
+        }
+        return true;
+    }
+
+    unsigned char scale[256];
+    for (uint32_t i = 0; i < 256; ++i)
+        scale[i] = i >= maxValue ? 255 : (unsigned char)((i * 255 + maxValue / 2) / maxValue);
+
+    for (int y = 0; y < height; ++y) {
+        const unsigned char* src = data + offset + rowBytes * y;
+        //Plain RGB rows go out of the file untouched.
+        if (channels == 3 && maxValue == 255) {
+            callback(user, src, y, width, height, 3);
+            continue;
+        }
+        ShuffleRow(src, row.data());
+        if (maxValue != 255)
+            for (unsigned char& value : row)
+                value = scale[value];
+        callback(user, row.data(), y, width, height, 3);
+    }
+    return true;
+}
+
+bool NativeDecoder::Decode16(uint16_t* rgb) const {
+    if (!IsValid() || depth != 16)
+        return false;
+
+    size_t rowBytes = (size_t)width * layout.inBytes;
+    for (int y = 0; y < height; ++y) {
+        uint16_t* dst = rgb + (size_t)y * width * 3;
+        ShuffleRow(data + offset + rowBytes * y, (unsigned char*)dst);
+        if (maxValue != 65535)
+            ScaleRow16(dst);
+    }
+    return true;
+}
+
+bool NativeDecoder::DecodeQOI(RowCallback callback, void* user) const {
+    std::vector<unsigned char> row((size_t)width * 3);
+    unsigned char index[64][4] = {};
+    unsigned char px[4] = { 0, 0, 0, 255 };
+    int run = 0;
+
+    //Ops stop before the 8 byte end marker, so an op can read its arguments without
+    //checking. A truncated stream repeats its last pixel like the reference decoder.
+    const unsigned char* p = data + offset;
+    const unsigned char* end = data + size - 8;
+
+    for (int y = 0; y < height; ++y) {
+        unsigned char* out = row.data();
+        for (int x = 0; x < width; ++x, out += 3) {
+            if (run > 0) {
+                --run;
+            } else if (p < end) {
+                int op = *p++;
+                if (op == 0xfe) {
+                    memcpy(px, p, 3);
+                    p += 3;
+                } else if (op == 0xff) {
+                    memcpy(px, p, 4);
+                    p += 4;
+                } else {
+                    switch (op >> 6) {
+                    case 0:
+                        memcpy(px, index[op], 4);
+                        break;
+                    case 1:
+                        px[0] += ((op >> 4) & 3) - 2;
+                        px[1] += ((op >> 2) & 3) - 2;
+                        px[2] += (op & 3) - 2;
+                        break;
+                    case 2: {
+                        int dg = (op & 0x3f) - 32;
+                        int rb = *p++;
+                        px[0] += dg - 8 + (rb >> 4);
+                        px[1] += dg;
+                        px[2] += dg - 8 + (rb & 0x0f);
+                        break;
+                    }
+                    default:
+                        run = op & 0x3f;
+                        break;
+                    }
+                }
+                memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) & 63], px, 4);
+            }
+            out[0] = px[0];
+            out[1] = px[1];
+            out[2] = px[2];
+        }
+        callback(user, row.data(), y, width, height, 3);
+    }
+    return true;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+//Decoders for formats simple enough to read straight from the file: QOI, farbfeld and
+//binary PGM/PPM/PAM. They are picked by magic number before anything goes to stb.
+class NativeDecoder {
+public:
+    //Same shape as stb's row callback so the rows go through the same sampling path.
+    typedef void (*RowCallback)(void* user, const unsigned char* row, int y, int width, int height, int channels);
+
+    NativeDecoder() = delete;
+    //Reads the header only, invalid when the data isn't one of the formats or is truncated.
+    NativeDecoder(const unsigned char* data, size_t size);
+
+    inline bool IsValid() const { return width > 0 && height > 0; }
+    inline int GetWidth() const { return width; }
+    inline int GetHeight() const { return height; }
+    //Channels in the file, alpha included.
+    inline int GetChannels() const { return channels; }
+    //16 bit samples, farbfeld and PNM with a max value over 255.
+    inline bool IsWide() const { return depth == 16; }
+
+    //Hand out RGB8 rows top to bottom, 16 bit samples are cut to their high byte like stb does.
+    bool DecodeRows(RowCallback callback, void* user) const;
+
+    //Decode 16 bit samples to width * height RGB16 pixels.
+    bool Decode16(uint16_t* rgb) const;
+
+private:
+    enum class Format { None, QOI, Farbfeld, PNM };
+
+    //Byte shuffle from a pixel of the file to an RGB pixel.
+    struct Layout {
+        int inBytes = 0;
+        int outBytes = 0;
+        int step = 0; //Pixels a 16 byte shuffle moves.
+        unsigned char map[6]{}; //Output byte to input byte within a pixel.
+        unsigned char mask[16]{}; //map repeated for step pixels.
+    };
+
+    bool ReadQOI();
+    bool ReadFarbfeld();
+    bool ReadPNM();
+    void SetLayout();
+
+    bool DecodeQOI(RowCallback callback, void* user) const;
+    void ShuffleRow(const unsigned char* src, unsigned char* dst) const;
+    void ScaleRow16(uint16_t* row) const;
+
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    size_t offset = 0; //Start of the pixels.
+    Format format = Format::None;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int depth = 8;
+    uint32_t maxValue = 255;
+    Layout layout{};
+};
@@ -1,17 +1,972 @@
 #include "image.hpp"
+#include "input.hpp"
+#include "decoder.hpp"
+#include "thumbnail.hpp"
+#include "cache.hpp"
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
 
-Image::Image(const char* filename) {
-    data = stbi_load(filename, &width, &height, &channels, 3);
+//Task runner handed to stb, spreads the tasks over threadCount threads including the calling one.
+static void RunDecodeTasks(void* user, stbi_task* task, void* data, int count) {
+    uint32_t threadCount = *(uint32_t*)user;
+    if (threadCount == 0)
+        threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    threadCount = std::min(threadCount, (uint32_t)count);
+
+    std::atomic<int> next{ 0 };
+    auto worker = [&]() {
+        for (int i = next++; i < count; i = next++)
+            task(data, i);
+    };
+
+    std::vector<std::thread> threads{};
+    for (uint32_t i = 1; i < threadCount; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+//Smallest box size that brings the image within maxPixels pixels.
+static uint32_t GetBoxFactor(int width, int height, uint32_t maxPixels) {
+    uint64_t pixels = (uint64_t)width * (uint64_t)height;
+    uint32_t factor = 1;
+    while (maxPixels > 0 && pixels > maxPixels) {
+        ++factor;
+        pixels = (uint64_t)((width + factor - 1) / factor) * (uint64_t)((height + factor - 1) / factor);
+    }
+    return factor;
+}
+
+//Receives decoded rows from stb and box-filters them into the image as they arrive,
+//so only the reduced image is ever stored.
+struct Image::RowDecoder {
+    Image* image = nullptr;
+    RowSampler* sampler = nullptr;
+    ColorHistogram* histogram = nullptr;
+    uint32_t maxPixels = 0;
+    bool toLab = false;
+    uint32_t factor = 1;
+    int sourceWidth = 0;
+    int sourceHeight = 0;
+    int bandRows = 0;
+    std::vector<uint32_t> sums{};
+    std::vector<unsigned char> row{};
+    std::vector<unsigned char> rgb{}; //Source row of OnYCbCrRow when it is box-filtered.
+
+    //Rows are always asked for as RGB, the channel count stb passes along is always 3.
+    static void OnRow(void* user, const unsigned char* src, int y, int width, int height, int /*channels*/) {
+        RowDecoder* decoder = (RowDecoder*)user;
+        if (y == 0)
+            decoder->Begin(width, height);
+        decoder->Add(src, y);
+    }
+
+    //YCbCr jpeg rows when they go to OkLab planes, converted straight to them unless they are box-filtered first.
+    static void OnYCbCrRow(void* user, const unsigned char* luma, const unsigned char* cb, const unsigned char* cr, int y, int width, int height) {
+        RowDecoder* decoder = (RowDecoder*)user;
+        if (y == 0)
+            decoder->Begin(width, height);
+        if (decoder->factor == 1) {
+            decoder->image->StoreYCbCrRow(luma, cb, cr, y);
+            return;
+        }
+
+        decoder->rgb.resize((size_t)width * 3);
+        for (int x = 0; x < width; ++x) {
+            RGB8 color = YCbCrToRGB8(luma[x], cb[x], cr[x]);
+            decoder->rgb[x * 3] = color.r;
+            decoder->rgb[x * 3 + 1] = color.g;
+            decoder->rgb[x * 3 + 2] = color.b;
+        }
+        decoder->Add(decoder->rgb.data(), y);
+    }
+
+    void Begin(int width, int height) {
+        sourceWidth = width;
+        sourceHeight = height;
+
+        factor = GetBoxFactor(width, height, maxPixels);
+        image->width = (width + factor - 1) / factor;
+        image->height = (height + factor - 1) / factor;
+        size_t size = (size_t)image->width * image->height;
+        if (sampler)
+            sampler->Begin(image->width, image->height);
+        else if (toLab)
+            image->lab.Resize(size);
+        else if (!histogram)
+            image->pixels.resize(size * 3);
+
+        sums.assign((size_t)image->width * 3, 0);
+        row.resize((size_t)image->width * 3);
+        bandRows = 0;
+    }
+
+    void Add(const unsigned char* src, int y) {
+        if (factor == 1) {
+            Emit(src, y);
+            return;
+        }
+
+        for (int x = 0; x < sourceWidth; ++x) {
+            uint32_t* sum = &sums[(x / factor) * 3];
+            sum[0] += src[x * 3];
+            sum[1] += src[x * 3 + 1];
+            sum[2] += src[x * 3 + 2];
+        }
+        ++bandRows;
+
+        if (bandRows < (int)factor && y != sourceHeight - 1)
+            return;
+
+        for (int x = 0; x < image->width; ++x) {
+            int colStart = x * factor;
+            int colEnd = std::min(colStart + (int)factor, sourceWidth);
+            uint32_t count = (uint32_t)(colEnd - colStart) * (uint32_t)bandRows;
+            row[x * 3] = (sums[x * 3] + count / 2) / count;
+            row[x * 3 + 1] = (sums[x * 3 + 1] + count / 2) / count;
+            row[x * 3 + 2] = (sums[x * 3 + 2] + count / 2) / count;
+        }
+        Emit(row.data(), y / factor);
+
+        std::fill(sums.begin(), sums.end(), 0);
+        bandRows = 0;
+    }
+
+    void Emit(const unsigned char* src, int y) {
+        if (sampler)
+            sampler->AddRow(src, y);
+        else if (histogram)
+            histogram->AddRow(src, image->width);
+        else
+            image->StoreRow(src, y);
+    }
+};
+
+//Receives the frames of an animated gif one at a time and merges the selected ones into
+//a color histogram, or into reservoir samples when streaming, so frames are never stacked.
+struct Image::FrameMerger {
+    const ImageOptions* options = nullptr;
+    RowSampler* sampler = nullptr;
+    std::unordered_map<uint32_t, uint32_t> histogram{};
+    std::vector<unsigned char> row{};
+    int width = 0;
+    int height = 0;
+    uint32_t merged = 0;
+
+    //Every merged frame counts the same whatever its delay.
+    static int OnFrame(void* user, const unsigned char* rgba, int frame, int width, int height, int /*delay*/, int keyframe) {
+        FrameMerger* merger = (FrameMerger*)user;
+        merger->width = width;
+        merger->height = height;
+
+        //The first frame is always merged so keyframes only can't end up empty.
+        if (frame == 0 || (frame % merger->options->frameStep == 0 && (keyframe || !merger->options->keyframes)))
+            merger->Add(rgba);
+        return 1;
+    }
+
+    void Add(const unsigned char* rgba) {
+        size_t count = (size_t)width * height;
+
+        if (sampler) {
+            if (merged == 0)
+                sampler->Begin(width, height);
+            row.resize((size_t)width * 3);
+            for (int y = 0; y < height; ++y) {
+                const unsigned char* src = rgba + (size_t)y * width * 4;
+                for (int x = 0; x < width; ++x)
+                    memcpy(&row[x * 3], &src[x * 4], 3);
+                //Frames follow each other as one tall image.
+                sampler->AddRow(row.data(), (int)merged * height + y);
+            }
+            ++merged;
+            return;
+        }
+
+        //Neighbouring pixels mostly share a color, skip the lookup for runs.
+        uint32_t lastKey = UINT32_MAX;
+        uint32_t* lastCount = nullptr;
+        for (size_t i = 0; i < count; ++i, rgba += 4) {
+            uint32_t key = (uint32_t)rgba[0] | ((uint32_t)rgba[1] << 8) | ((uint32_t)rgba[2] << 16);
+            if (key != lastKey) {
+                lastCount = &histogram[key];
+                lastKey = key;
+            }
+            ++*lastCount;
+        }
+        ++merged;
+    }
+};
+
+//Row converters picked by pixel type in StoreWide.
+static void RowToLab(const uint16_t* src, uint32_t count, float* L, float* a, float* b) {
+    RGB16RowToLab(src, count, 3, L, a, b);
+}
+
+static void RowToLab(const float* src, uint32_t count, float* L, float* a, float* b) {
+    LinearRowToLab(src, count, 3, L, a, b);
+}
+
+//Linear light of a wide row and back, picked by pixel type in BoxFilterWide. Hdr pixels already are linear.
+static void WideRowToLinear(const uint16_t* src, size_t count, float* dst) {
+    const float* toLinear = GetSRGB16ToLinearTable();
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = toLinear[src[i]];
+}
+
+static void WideRowToLinear(const float* src, size_t count, float* dst) {
+    std::copy(src, src + count, dst);
+}
+
+static void LinearToWideRow(float* src, size_t count, uint16_t* dst) {
+    LinearToGammaPlane(src, count, src);
+    for (size_t i = 0; i < count; ++i)
+        dst[i] = (uint16_t)std::clamp(lroundf(src[i] * 65535.0f), 0L, 65535L);
+}
+
+static void LinearToWideRow(float* src, size_t count, float* dst) {
+    std::copy(src, src + count, dst);
+}
+
+//Box-filter wide pixels by factor in linear light the way RowDecoder does 8 bit rows, keeping their format.
+//Blocks on the right and bottom edges average the pixels they have.
+template<typename T>
+static std::vector<T> BoxFilterWide(const T* data, int width, int height, uint32_t factor) {
+    int outWidth = (width + factor - 1) / factor;
+    int outHeight = (height + factor - 1) / factor;
+    size_t rowSize = (size_t)width * 3;
+    std::vector<T> result((size_t)outWidth * outHeight * 3);
+    std::vector<float> linear(rowSize);
+    std::vector<float> sums((size_t)outWidth * 3);
+
+    for (int outY = 0; outY < outHeight; ++outY) {
+        std::fill(sums.begin(), sums.end(), 0.0f);
+        int rowStart = outY * factor;
+        int rowEnd = std::min(rowStart + (int)factor, height);
+        for (int y = rowStart; y < rowEnd; ++y) {
+            WideRowToLinear(data + rowSize * y, rowSize, linear.data());
+            for (int x = 0; x < width; ++x) {
+                float* sum = &sums[(x / factor) * 3];
+                sum[0] += linear[x * 3];
+                sum[1] += linear[x * 3 + 1];
+                sum[2] += linear[x * 3 + 2];
+            }
+        }
+
+        for (int x = 0; x < outWidth; ++x) {
+            int colStart = x * factor;
+            int colEnd = std::min(colStart + (int)factor, width);
+            float count = (float)((colEnd - colStart) * (rowEnd - rowStart));
+            sums[x * 3] /= count;
+            sums[x * 3 + 1] /= count;
+            sums[x * 3 + 2] /= count;
+        }
+        LinearToWideRow(sums.data(), sums.size(), &result[(size_t)outY * outWidth * 3]);
+    }
+    return result;
+}
+
+//Add two rows of 14 bit linear values, the sums of a 2x2 block still fit in 16 bits.
+static void AddRows(const uint16_t* a, const uint16_t* b, uint16_t* sum, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 8 <= count; i += 8) {
+        __m128i top = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i bottom = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(sum + i), _mm_add_epi16(top, bottom));
+    }
+#endif
+    for (; i < count; ++i)
+        sum[i] = a[i] + b[i];
+}
+
+//Half an RGB8 image with a 2x2 box filter in linear light, averaging the sRGB codes would darken edges.
+//Odd sizes repeat their last row and column.
+static void DownsampleLinear(const unsigned char* src, int width, int height, unsigned char* dst) {
+    const uint16_t* toLinear = GetSRGB8ToLinear14Table();
+    const unsigned char* toGamma = GetLinear14ToSRGB8Table();
+    int outWidth = (width + 1) / 2;
+    int outHeight = (height + 1) / 2;
+    size_t rowSize = (size_t)width * 3;
+    std::vector<uint16_t> top(rowSize), bottom(rowSize), sum(rowSize);
+
+    for (int y = 0; y < outHeight; ++y) {
+        const unsigned char* a = src + rowSize * (size_t)(y * 2);
+        const unsigned char* b = y * 2 + 1 < height ? a + rowSize : a;
+        for (size_t i = 0; i < rowSize; ++i) {
+            top[i] = toLinear[a[i]];
+            bottom[i] = toLinear[b[i]];
+        }
+        AddRows(top.data(), bottom.data(), sum.data(), rowSize);
+
+        unsigned char* out = dst + (size_t)y * outWidth * 3;
+        for (int x = 0; x < outWidth; ++x, out += 3) {
+            const uint16_t* left = &sum[(size_t)x * 6];
+            const uint16_t* right = x * 2 + 1 < width ? left + 3 : left;
+            out[0] = toGamma[(left[0] + right[0] + 2) >> 2];
+            out[1] = toGamma[(left[1] + right[1] + 2) >> 2];
+            out[2] = toGamma[(left[2] + right[2] + 2) >> 2];
+        }
+    }
+}
+
+Image::Image(const char* filename) : Image(filename, ImageOptions{}) {}
+
+Image::Image(const char* filename, const ImageOptions& options) : mipSamples(options.mipSamples) {
+    InputFile file{ filename };
+    if (!file.IsValid() || file.GetSize() > INT_MAX)
+        return;
+
+    //QOI, farbfeld and PNM don't go through stb, sniffed here by their magic.
+    NativeDecoder native{ file.GetData(), file.GetSize() };
+
+    //Out of core images only count 8 bit rows unless they are sampled.
+    bool wide = !options.outOfCore || options.samples > 0;
+    if ((wide && (LoadNativeWide(native, options) || LoadWide(file.GetData(), (int)file.GetSize(), options))) || LoadFrames(file.GetData(), (int)file.GetSize(), options)) {
+        fileSize = file.GetSize();
+        parsedBytes = fileSize;
+        return;
+    }
+
+    RowDecoder decoder{};
+    decoder.image = this;
+    decoder.maxPixels = options.maxPixels;
+
+    RowSampler sampler{ options.sampler, options.samples, options.seed };
+    ColorHistogram histogram{};
+    if (options.samples > 0)
+        decoder.sampler = &sampler;
+    else if (options.outOfCore)
+        decoder.histogram = &histogram;
+    decoder.toLab = options.lab && !decoder.histogram;
+
+    int bytesParsed = 0;
+    stbi_load_options loadOptions{};
+    loadOptions.jpeg_scale = options.jpegScale;
+    loadOptions.row_callback = RowDecoder::OnRow;
+    if (decoder.toLab && !decoder.sampler)
+        loadOptions.ycbcr_callback = RowDecoder::OnYCbCrRow;
+    loadOptions.row_user = &decoder;
+    loadOptions.preview = options.preview;
+    loadOptions.bytes_parsed = &bytesParsed;
+    loadOptions.low_memory = options.outOfCore;
+    int banded = 0;
+    loadOptions.banded = &banded;
+    uint32_t threads = options.threads;
+    if (threads != 1) {
+        loadOptions.run_tasks = RunDecodeTasks;
+        loadOptions.run_tasks_user = &threads;
+    }
+    unsigned char paletteRGBA[256 * 4];
+    int paletteSize = 0;
+    //Indices would keep a byte per pixel around, streaming keeps only the samples or the histogram.
+    if (options.palette && options.samples == 0 && !options.outOfCore) {
+        loadOptions.palette = paletteRGBA;
+        loadOptions.palette_size = &paletteSize;
+    }
+
+    if (loadOptions.jpeg_scale == 0 && options.maxPixels > 0) {
+        int fullWidth, fullHeight, fullChannels;
+        if (stbi_info_from_memory(file.GetData(), (int)file.GetSize(), &fullWidth, &fullHeight, &fullChannels))
+            loadOptions.jpeg_scale = GetJpegScaleForBudget(fullWidth, fullHeight, options.maxPixels);
+    }
+
+    if (native.IsValid()) {
+        if (!native.DecodeRows(RowDecoder::OnRow, &decoder)) {
+            width = 0;
+            height = 0;
+            return;
+        }
+        channels = native.GetChannels();
+        this->banded = true;
+        if (decoder.sampler)
+            samples = std::move(sampler.GetSamples());
+        if (decoder.histogram)
+            palette = histogram.GetEntries();
+        fileSize = file.GetSize();
+        parsedBytes = fileSize;
+        return;
+    }
+
+    int decodedWidth, decodedHeight;
+    unsigned char* result = stbi_load_from_memory_ex(file.GetData(), (int)file.GetSize(), &decodedWidth, &decodedHeight, &channels, 3, &loadOptions);
+    if (!result) {
+        width = 0;
+        height = 0;
+        pixels.clear();
+        lab = LabPlanes{};
+        palette.clear();
+        samples.clear();
+        return;
+    }
+    if (paletteSize > 0) {
+        width = decodedWidth;
+        height = decodedHeight;
+        StoreIndexed(result, paletteRGBA, paletteSize);
+    }
+    stbi_image_free(result);
+    if (decoder.sampler)
+        samples = std::move(sampler.GetSamples());
+    if (decoder.histogram)
+        palette = histogram.GetEntries();
+    this->banded = banded != 0;
+
+    fileSize = file.GetSize();
+    parsedBytes = (size_t)bytesParsed;
 }
 
 Image::~Image() {
-    stbi_image_free(data);
+}
+
+ImageView Image::GetMipLevel(size_t maxPixels) {
+    ImageView level = GetView();
+    if (!level.IsValid())
+        return level;
+
+    for (size_t i = 0; (size_t)level.GetWidth() * level.GetHeight() > maxPixels && (level.GetWidth() > 1 || level.GetHeight() > 1); ++i) {
+        if (i == mips.size()) {
+            MipLevel mip{};
+            mip.width = (level.GetWidth() + 1) / 2;
+            mip.height = (level.GetHeight() + 1) / 2;
+            mip.pixels.resize((size_t)mip.width * mip.height * 3);
+            DownsampleLinear(level.GetRow(0), level.GetWidth(), level.GetHeight(), mip.pixels.data());
+            mips.push_back(std::move(mip));
+        }
+        level = ImageView{ mips[i].pixels.data(), mips[i].width, mips[i].height, 0, ViewFormat::RGB8 };
+    }
+    return level;
+}
+
+size_t ImageView::GetSamplesLab(size_t d, size_t first, size_t count, float* L, float* a, float* b) const {
+    size_t end = std::min(GetSampleCount(d), first + count);
+    size_t channels = GetChannels();
+    const float* toLinear = GetSRGB8ToLinearTable();
+    const LabLUT* lut = GetLabLUT();
+    if (first >= end)
+        return 0;
+
+    //Samples i * d of row y are the ones from ceil(y * width / d) up to ceil((y + 1) * width / d).
+    size_t i = first;
+    for (int y = (int)(first * d / width); y < height && i < end; ++y) {
+        size_t rowEnd = std::min(end, ((size_t)(y + 1) * width + d - 1) / d);
+        if (rowEnd <= i)
+            continue;
+        const unsigned char* src = GetRow(y) + (i * d - (size_t)y * width) * channels;
+        size_t o = i - first;
+        if (format == ViewFormat::BGRA8 && lut) {
+            lut->RowToLab(src, rowEnd - i, channels * d, true, L + o, a + o, b + o);
+        } else if (format == ViewFormat::BGRA8) {
+            PixelsToLab(src, rowEnd - i, channels * d, L + o, a + o, b + o, [toLinear](const unsigned char* p, float& r, float& g, float& b) {
+                r = toLinear[p[2]];
+                g = toLinear[p[1]];
+                b = toLinear[p[0]];
+            });
+        } else {
+            RGB8RowToLab(src, rowEnd - i, channels * d, L + o, a + o, b + o);
+        }
+        i = rowEnd;
+    }
+    return i - first;
+}
+
+size_t Image::GetSampleCount() {
+    if (IsSampled())
+        return samples.size();
+    ImageView mip = mipSamples ? GetSampleLevel() : ImageView{};
+    if (mip.IsValid())
+        return mip.GetSampleCount(1);
+    return (size_t)width * height / 8;
+}
+
+void Image::GetSamplesLab(size_t first, size_t count, float* L, float* a, float* b) {
+    if (IsSampled()) {
+        for (size_t i = 0; i < count; ++i) {
+            L[i] = samples[first + i].L;
+            a[i] = samples[first + i].a;
+            b[i] = samples[first + i].b;
+        }
+        return;
+    }
+
+    size_t d = 8;
+    ImageView mip = mipSamples ? GetSampleLevel() : ImageView{};
+    if (mip.IsValid()) {
+        mip.GetSamplesLab(1, first, count, L, a, b);
+        return;
+    }
+    ImageView view = GetView();
+    if (view.IsValid()) {
+        view.GetSamplesLab(d, first, count, L, a, b);
+        return;
+    }
+
+    //Wide pixels are strided over in one pass, OkLab planes only need picking.
+    if (IsLab()) {
+        for (size_t i = 0; i < count; ++i) {
+            L[i] = lab.L[(first + i) * d];
+            a[i] = lab.a[(first + i) * d];
+            b[i] = lab.b[(first + i) * d];
+        }
+    } else if (format == PixelFormat::RGB16) {
+        RGB16RowToLab(pixels16.data() + first * d * 3, count, 3 * d, L, a, b);
+    } else if (format == PixelFormat::LinearF) {
+        LinearRowToLab(linear.data() + first * d * 3, count, 3 * d, L, a, b);
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            Lab color = GetPixelLab((first + i) * d);
+            L[i] = color.L;
+            a[i] = color.a;
+            b[i] = color.b;
+        }
+    }
+}
+
+LabPlanes Image::CollectSamples() {
+    LabPlanes data{};
+    data.Resize(GetSampleCount());
+    GetSamplesLab(0, data.Size(), data.L.data(), data.a.data(), data.b.data());
+    return data;
+}
+
+std::vector<Lab16> Image::CollectCompactSamples() {
+    std::vector<Lab16> data(GetSampleCount());
+    ConvertToLab16(data.size(), data.data(), [this](size_t first, size_t count, float* L, float* a, float* b) {
+        GetSamplesLab(first, count, L, a, b);
+    });
+    return data;
+}
+
+uint32_t Image::GetJpegScaleForBudget(int width, int height, uint32_t maxPixels) {
+    uint32_t scale = 1;
+    while (scale < 8) {
+        uint64_t nextWidth = (width + scale * 2 - 1) / (scale * 2);
+        uint64_t nextHeight = (height + scale * 2 - 1) / (scale * 2);
+        if (nextWidth * nextHeight < maxPixels)
+            break;
+        scale *= 2;
+    }
+    return scale;
+}
+
+void Image::StoreRow(const unsigned char* row, int y) {
+    size_t offset = (size_t)y * width;
+    if (IsLab())
+        RGB8RowToLab(row, width, 3, &lab.L[offset], &lab.a[offset], &lab.b[offset]);
+    else
+        memcpy(&pixels[offset * 3], row, (size_t)width * 3);
+}
+
+void Image::StoreYCbCrRow(const unsigned char* luma, const unsigned char* cb, const unsigned char* cr, int y) {
+    size_t offset = (size_t)y * width;
+    YCbCrRowToLab(luma, cb, cr, width, &lab.L[offset], &lab.a[offset], &lab.b[offset]);
+}
+
+void Image::StoreIndexed(const unsigned char* indices, const unsigned char* rgba, int paletteSize) {
+    size_t count = (size_t)width * height;
+    pixels.assign(indices, indices + count);
+
+    //Four tables so runs of the same index don't wait on each other's increments.
+    uint32_t histograms[4][256] = {};
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        ++histograms[0][indices[i]];
+        ++histograms[1][indices[i + 1]];
+        ++histograms[2][indices[i + 2]];
+        ++histograms[3][indices[i + 3]];
+    }
+    for (; i < count; ++i)
+        ++histograms[0][indices[i]];
+
+    //Corrupt files can index past the palette, those entries stay black like stb expands them.
+    palette.resize(256);
+    for (int j = 0; j < 256; ++j) {
+        unsigned char entry[3] = { 0, 0, 0 };
+        if (j < paletteSize)
+            memcpy(entry, &rgba[j * 4], 3);
+        palette[j].rgb = RGB{ entry[0] / 255.0f, entry[1] / 255.0f, entry[2] / 255.0f };
+        palette[j].lab = ColorTo<Lab>(RGB8{ entry[0], entry[1], entry[2] });
+        palette[j].count = histograms[0][j] + histograms[1][j] + histograms[2][j] + histograms[3][j];
+    }
+}
+
+//Counts the images of a gif up to limit by walking its blocks, without decoding any of them.
+static int CountGifFrames(const unsigned char* data, int size, int limit) {
+    if (size < 13)
+        return 0;
+    //Header and logical screen descriptor, then the global color table.
+    size_t pos = 13;
+    if (data[10] & 0x80)
+        pos += (size_t)3 << ((data[10] & 7) + 1);
+
+    int frames = 0;
+    while (frames < limit && pos < (size_t)size) {
+        unsigned char block = data[pos++];
+        if (block == 0x2C) {
+            if (pos + 9 > (size_t)size)
+                break;
+            unsigned char flags = data[pos + 8];
+            pos += 9;
+            if (flags & 0x80)
+                pos += (size_t)3 << ((flags & 7) + 1);
+            ++pos; //LZW minimum code size.
+            ++frames;
+        } else if (block == 0x21) {
+            ++pos; //Extension label.
+        } else {
+            break;
+        }
+        //Data sub-blocks up to the empty one.
+        while (pos < (size_t)size && data[pos] != 0)
+            pos += (size_t)data[pos] + 1;
+        ++pos;
+    }
+    return frames;
+}
+
+bool Image::LoadFrames(const unsigned char* data, int size, const ImageOptions& options) {
+    if (options.frameStep == 0 || size < 6 || memcmp(data, "GIF8", 4) != 0)
+        return false;
+    //A gif with a single frame goes through the usual path, palette indices included, without being decoded twice.
+    if (CountGifFrames(data, size, 2) < 2)
+        return false;
+
+    //Reservoir is the only sampler that doesn't need to know how many frames will come, it is sized by
+    //options.samples rather than by the first frame so later frames are sampled as much as the first.
+    RowSampler sampler{ SampleMode::Reservoir, options.samples, options.seed };
+    FrameMerger merger{};
+    merger.options = &options;
+    if (options.samples > 0)
+        merger.sampler = &sampler;
+
+    //Corrupt gifs that stop after their first frame fall back to the usual path too.
+    if (stbi_load_gif_frames_from_memory(data, size, FrameMerger::OnFrame, &merger) < 2)
+        return false;
+
+    width = merger.width;
+    height = merger.height;
+    channels = 4;
+    frameCount = merger.merged;
+
+    if (merger.sampler) {
+        samples = std::move(sampler.GetSamples());
+        return true;
+    }
+
+    palette.reserve(merger.histogram.size());
+    for (const auto& [key, count] : merger.histogram) {
+        unsigned char rgb[3] = { (unsigned char)key, (unsigned char)(key >> 8), (unsigned char)(key >> 16) };
+        PaletteEntry entry{};
+        entry.rgb = RGB{ rgb[0] / 255.0f, rgb[1] / 255.0f, rgb[2] / 255.0f };
+        entry.lab = ColorTo<Lab>(RGB8{ rgb[0], rgb[1], rgb[2] });
+        entry.count = count;
+        palette.push_back(entry);
+    }
+    //Hash map order changes between runs of the standard library, keep the quantizers deterministic.
+    std::sort(palette.begin(), palette.end(), [](const PaletteEntry& a, const PaletteEntry& b) {
+        return a.count != b.count ? a.count > b.count : a.lab.L < b.lab.L;
+    });
+    return true;
+}
+
+bool Image::LoadNativeWide(const NativeDecoder& native, const ImageOptions& options) {
+    if (!native.IsValid() || !native.IsWide())
+        return false;
+
+    width = native.GetWidth();
+    height = native.GetHeight();
+    channels = native.GetChannels();
+    format = PixelFormat::RGB16;
+    size_t count = (size_t)width * height * 3;
+
+    //Kept as they are the pixels are decoded in place, anything else goes through StoreWide.
+    if (options.samples == 0 && !options.lab && GetBoxFactor(width, height, options.maxPixels) == 1) {
+        pixels16.resize(count);
+        native.Decode16(pixels16.data());
+        return true;
+    }
+
+    std::vector<uint16_t> result(count);
+    native.Decode16(result.data());
+    StoreWide(result.data(), options, pixels16);
+    return true;
+}
+
+bool Image::LoadWide(const unsigned char* data, int size, const ImageOptions& options) {
+    if (stbi_is_hdr_from_memory(data, size)) {
+        float* result = stbi_loadf_from_memory(data, size, &width, &height, &channels, 3);
+        if (!result) {
+            width = 0;
+            height = 0;
+            return true;
+        }
+        format = PixelFormat::LinearF;
+        StoreWide(result, options, linear);
+        stbi_image_free(result);
+        return true;
+    }
+
+    if (stbi_is_16_bit_from_memory(data, size)) {
+        uint16_t* result = stbi_load_16_from_memory(data, size, &width, &height, &channels, 3);
+        if (!result) {
+            width = 0;
+            height = 0;
+            return true;
+        }
+        format = PixelFormat::RGB16;
+        StoreWide(result, options, pixels16);
+        stbi_image_free(result);
+        return true;
+    }
+
+    return false;
+}
+
+template<typename T>
+void Image::StoreWide(const T* data, const ImageOptions& options, std::vector<T>& storage) {
+    std::vector<T> reduced{};
+    uint32_t factor = GetBoxFactor(width, height, options.maxPixels);
+    if (factor > 1) {
+        reduced = BoxFilterWide(data, width, height, factor);
+        width = (width + factor - 1) / factor;
+        height = (height + factor - 1) / factor;
+        data = reduced.data();
+    }
+    size_t rowSize = (size_t)width * 3;
+
+    if (options.samples > 0) {
+        RowSampler sampler{ options.sampler, options.samples, options.seed };
+        sampler.Begin(width, height);
+        for (int y = 0; y < height; ++y)
+            sampler.AddRow(data + rowSize * y, y);
+        samples = std::move(sampler.GetSamples());
+        return;
+    }
+
+    if (options.lab) {
+        lab.Resize((size_t)width * height);
+        for (int y = 0; y < height; ++y) {
+            size_t offset = (size_t)y * width;
+            RowToLab(data + rowSize * y, width, &lab.L[offset], &lab.a[offset], &lab.b[offset]);
+        }
+        return;
+    }
+
+    storage.assign(data, data + rowSize * height);
 }
 
 std::shared_ptr<Image> Image::Open(const char* filename) {
     return std::make_shared<Image>(filename);
-}
\ No newline at end of file
+}
+
+std::shared_ptr<Image> Image::Open(const char* filename, const ImageOptions& options) {
+    //A thumbnail that fails to decode falls back to the image itself like a missing one.
+    if (options.preferThumbnail) {
+        std::string thumbnail = FindThumbnail(filename);
+        if (!thumbnail.empty()) {
+            std::shared_ptr<Image> image = Load(thumbnail.c_str(), options);
+            if (image->IsValid())
+                return image;
+        }
+    }
+    return Load(filename, options);
+}
+
+std::shared_ptr<Image> Image::Load(const char* filename, const ImageOptions& options) {
+    if (options.cache) {
+        std::shared_ptr<Image> image{ new Image{} };
+        if (image->LoadCache(filename, options))
+            return image;
+    }
+
+    std::shared_ptr<Image> image = std::make_shared<Image>(filename, options);
+    if (options.cache && image->IsValid())
+        image->StoreCache(filename, options);
+    return image;
+}
+
+//Identifies a file and the options that change what is decoded from it. Entries start with it and
+//are compared byte for byte, so it is cleared padding included before being filled.
+struct Image::CacheKey {
+    char magic[8];
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtimeNanoseconds;
+    uint32_t maxPixels;
+    uint32_t jpegScale;
+    uint32_t samples;
+    uint32_t seed;
+    uint32_t frameStep;
+    uint32_t labLut; //Size of the LabLUT in use, it is set for the whole process rather than per image.
+    uint8_t sampler;
+    uint8_t lab;
+    uint8_t preview;
+    uint8_t palette;
+    uint8_t keyframes;
+    uint8_t outOfCore;
+    uint8_t colorKernel; //The wide kernels round differently from Scalar and SSE2, like labLut it is per process.
+    uint8_t mipSamples;
+
+    //False for stdin and anything else that isn't a regular file.
+    bool Make(const char* filename, const ImageOptions& options) {
+        memset((void*)this, 0, sizeof(*this));
+        struct stat info;
+        if (strcmp(filename, "-") == 0 || stat(filename, &info) != 0 || !S_ISREG(info.st_mode))
+            return false;
+
+        //Bump the version whenever what CollectSamples returns changes.
+        memcpy(magic, "LAINSMP5", 8);
+        device = (uint64_t)info.st_dev;
+        inode = (uint64_t)info.st_ino;
+        size = (uint64_t)info.st_size;
+        mtime = (int64_t)info.st_mtim.tv_sec;
+        mtimeNanoseconds = (int64_t)info.st_mtim.tv_nsec;
+        maxPixels = options.maxPixels;
+        jpegScale = options.jpegScale;
+        samples = options.samples;
+        seed = options.seed;
+        frameStep = options.frameStep;
+        sampler = (uint8_t)options.sampler;
+        lab = options.lab;
+        preview = options.preview;
+        palette = options.palette;
+        keyframes = options.keyframes;
+        outOfCore = options.outOfCore;
+        mipSamples = options.mipSamples;
+        labLut = GetLabLUT() ? GetLabLUT()->GetSize() : 0;
+        colorKernel = (uint8_t)GetColorKernel();
+        return true;
+    }
+
+    //Entry under $XDG_CACHE_HOME/lain named after the hash of the key, empty without a cache directory.
+    std::string GetPath() const {
+        std::string directory = GetCacheDirectory();
+        if (directory.empty())
+            return std::string{};
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.samples", (unsigned long long)HashBytes(this, sizeof(*this)));
+        return directory + "/lain/" + name;
+    }
+};
+
+//Followed by the samples then the palette entries, as they are in memory.
+struct Image::CacheHeader {
+    CacheKey key;
+    int32_t width;
+    int32_t height;
+    int32_t channels;
+    uint32_t frameCount;
+    uint64_t fileSize;
+    uint64_t parsedBytes;
+    uint64_t sampleCount;
+    uint64_t paletteCount;
+};
+
+bool Image::LoadCache(const char* filename, const ImageOptions& options) {
+    CacheKey key;
+    if (!key.Make(filename, options))
+        return false;
+    std::string path = key.GetPath();
+    if (path.empty())
+        return false;
+
+    InputFile file{ path.c_str() };
+    if (!file.IsValid() || file.GetSize() < sizeof(CacheHeader))
+        return false;
+    CacheHeader header;
+    memcpy((void*)&header, file.GetData(), sizeof(header));
+    if (memcmp((const void*)&header.key, (const void*)&key, sizeof(key)) != 0)
+        return false;
+
+    size_t available = file.GetSize() - sizeof(header);
+    if (header.sampleCount > available / sizeof(Lab) || header.paletteCount > available / sizeof(PaletteEntry)
+        || header.sampleCount * sizeof(Lab) + header.paletteCount * sizeof(PaletteEntry) != available)
+        return false;
+
+    width = header.width;
+    height = header.height;
+    channels = header.channels;
+    frameCount = header.frameCount;
+    fileSize = header.fileSize;
+    parsedBytes = header.parsedBytes;
+    //Entries hold either samples or a palette, memcpy must not see the data of the empty one even for 0 bytes.
+    const unsigned char* data = file.GetData() + sizeof(header);
+    samples.resize(header.sampleCount);
+    if (!samples.empty())
+        memcpy((void*)samples.data(), data, samples.size() * sizeof(Lab));
+    palette.resize(header.paletteCount);
+    if (!palette.empty())
+        memcpy((void*)palette.data(), data + samples.size() * sizeof(Lab), palette.size() * sizeof(PaletteEntry));
+    banded = true;
+    return IsValid() && (IsSampled() || HasPalette());
+}
+
+void Image::StoreCache(const char* filename, const ImageOptions& options) {
+    CacheHeader header;
+    memset((void*)&header, 0, sizeof(header));
+    if (!header.key.Make(filename, options))
+        return;
+    std::string path = header.key.GetPath();
+    if (path.empty() || !MakeDirectories(path.substr(0, path.rfind('/'))))
+        return;
+
+    //The image goes on as a sampled one so this run quantizes the same samples the next ones read back.
+    if (!HasPalette()) {
+        LabPlanes planes = CollectSamples();
+        samples.resize(planes.Size());
+        for (size_t i = 0; i < samples.size(); ++i)
+            samples[i] = Lab{ planes.L[i], planes.a[i], planes.b[i] };
+    }
+    if (!IsSampled() && !HasPalette())
+        return;
+
+    header.width = width;
+    header.height = height;
+    header.channels = channels;
+    header.frameCount = frameCount;
+    header.fileSize = fileSize;
+    header.parsedBytes = parsedBytes;
+    header.sampleCount = HasPalette() ? 0 : samples.size();
+    header.paletteCount = palette.size();
+
+    size_t sampleBytes = header.sampleCount * sizeof(Lab);
+    std::vector<unsigned char> buffer(sizeof(header) + sampleBytes + palette.size() * sizeof(PaletteEntry));
+    memcpy(buffer.data(), (const void*)&header, sizeof(header));
+    if (sampleBytes > 0)
+        memcpy(buffer.data() + sizeof(header), (const void*)samples.data(), sampleBytes);
+    if (!palette.empty())
+        memcpy(buffer.data() + sizeof(header) + sampleBytes, (const void*)palette.data(), palette.size() * sizeof(PaletteEntry));
+    WriteFileAtomic(path, buffer.data(), buffer.size());
+}
+
+bool Image::ReadSize(const char* filename, int& width, int& height) {
+    if (strcmp(filename, "-") == 0)
+        return false;
+    InputFile file{ filename };
+    if (!file.IsValid() || file.GetSize() > INT_MAX)
+        return false;
+    NativeDecoder native{ file.GetData(), file.GetSize() };
+    if (native.IsValid()) {
+        width = native.GetWidth();
+        height = native.GetHeight();
+        return true;
+    }
+    int channels;
+    return stbi_info_from_memory(file.GetData(), (int)file.GetSize(), &width, &height, &channels) != 0;
+}
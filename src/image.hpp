@@ -1,41 +1,294 @@
 #pragma once
 
 #include <memory>
+#include <vector>
+#include <algorithm>
 #include "color.hpp"
+#include "sampler.hpp"
 
+class NativeDecoder;
+
+
+struct ImageOptions {
+    uint32_t maxPixels = 0; //Box-filter the image down until it fits in this many pixels. (0 means no limit)
+    uint32_t jpegScale = 0; //Decode jpeg at 1/jpegScale of their size in the DCT domain. (1, 2, 4 or 8. 0 picks one from maxPixels)
+    bool lab = false; //Convert rows to OkLab planes as they are decoded instead of keeping RGB8 pixels.
+    bool preview = false; //Stop after the first pass of interlaced png or the DC scans of progressive jpeg. (1/8 size image)
+    uint32_t threads = 0; //Threads used to decode jpeg restart intervals. (0 uses every core, 1 decodes serially)
+    bool palette = true; //Keep paletted png and gif as indices and count them instead of expanding every pixel.
+    uint32_t samples = 0; //Only keep this many OkLab samples picked from the rows as they are decoded. (0 keeps the image)
+    SampleMode sampler = SampleMode::Stride; //How the samples are picked.
+    unsigned int seed = 0; //Seed of the reservoir and stratified samplers.
+    uint32_t frameStep = 1; //Merge every frameStep-th frame of animated gif into a color histogram. (0 only uses the first frame)
+    bool keyframes = false; //Only merge the animated gif frames that redraw the whole canvas.
+    bool outOfCore = false; //Decode jpeg a band of rows at a time and count rows into a 15 bit color histogram instead of keeping pixels.
+    bool preferThumbnail = false; //Open a valid freedesktop thumbnail of the image instead when there is one.
+    bool cache = false; //Keep the samples the quantizers use under $XDG_CACHE_HOME/lain and read them back instead of decoding.
+    bool mipSamples = false; //Sample every pixel of a linear light mip level instead of every 8th pixel, striped images don't alias.
+};
+
+//How an image keeps its pixels when they are not OkLab planes or palette indices.
+//16 bit and hdr sources keep their precision, the pixel budget box filter averages them in linear light.
+enum class PixelFormat {
+    RGB8, //8 bit sRGB.
+    RGB16, //16 bit sRGB, from 16 bit png and pnm.
+    LinearF //Linear float RGB, from radiance hdr.
+};
+
+//Pixel layouts an ImageView can read, 8 bit sRGB in every case.
+enum class ViewFormat {
+    RGB8,
+    RGBA8, //Alpha is ignored.
+    BGRA8 //What most compositors and windowing systems hand out.
+};
+
+//Non-owning view over pixels someone else holds, with a row stride and an optional region of interest.
+//Nothing is copied, the pixels must outlive the view.
+class ImageView {
+public:
+    ImageView() = default;
+    //A stride of 0 means rows are tightly packed.
+    ImageView(const unsigned char* data, int width, int height, size_t stride, ViewFormat format)
+        : data(data), width(width), height(height), format(format) {
+        this->stride = stride > 0 ? stride : (size_t)width * GetChannels();
+    }
+
+    //View of a sub-rectangle, clamped to this view.
+    inline ImageView Crop(int x, int y, int width, int height) const {
+        x = std::clamp(x, 0, this->width);
+        y = std::clamp(y, 0, this->height);
+        width = std::clamp(width, 0, this->width - x);
+        height = std::clamp(height, 0, this->height - y);
+        return ImageView{ data + y * stride + (size_t)x * GetChannels(), width, height, stride, format };
+    }
+
+    inline int GetWidth() const { return width; }
+    inline int GetHeight() const { return height; }
+    inline size_t GetStride() const { return stride; }
+    inline ViewFormat GetFormat() const { return format; }
+    inline int GetChannels() const { return format == ViewFormat::RGB8 ? 3 : 4; }
+    inline bool IsValid() const { return data && width > 0 && height > 0; }
+    inline const unsigned char* GetRow(int y) const { return data + y * stride; }
+
+    //Pixels are indexed row by row inside the view, like Image.
+    inline RGB8 GetPixelRGB8(size_t idx) const {
+        //Packed rows skip the division.
+        const unsigned char* p = stride == (size_t)width * GetChannels()
+            ? data + idx * GetChannels()
+            : GetRow(idx / width) + (idx % width) * GetChannels();
+        if (format == ViewFormat::BGRA8)
+            return RGB8{ p[2], p[1], p[0] };
+        return RGB8{ p[0], p[1], p[2] };
+    }
+
+    inline RGB GetPixelRGB(size_t idx) const {
+        RGB8 color = GetPixelRGB8(idx);
+        return RGB{ color.r / 255.0f, color.g / 255.0f, color.b / 255.0f };
+    }
+
+    inline Lab GetPixelLab(size_t idx) const {
+        return ColorTo<Lab>(GetPixelRGB8(idx));
+    }
+
+    //Number of samples GetSamplesLab takes every d-th pixel.
+    inline size_t GetSampleCount(size_t d) const { return (size_t)width * height / d; }
+
+    //OkLab of every d-th pixel, (width * height / d of them), converted a row at a time in bulk into L, a and b.
+    //Returns how many were written.
+    inline size_t GetSamplesLab(size_t d, float* L, float* a, float* b) const {
+        return GetSamplesLab(d, 0, GetSampleCount(d), L, a, b);
+    }
+
+    //Same as above for count samples starting at sample first.
+    size_t GetSamplesLab(size_t d, size_t first, size_t count, float* L, float* a, float* b) const;
+
+private:
+    const unsigned char* data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;
+    ViewFormat format = ViewFormat::RGB8;
+};
 
 class Image {
 public:
-    Image() = delete;
     Image(const char* filename);
+    Image(const char* filename, const ImageOptions& options);
     ~Image();
 
     inline int GetWidth() const { return width; }
     inline int GetHeight() const { return height; }
     inline int GetChannels() const { return channels; }
-    inline unsigned char* GetData() { return data; }
+    inline PixelFormat GetFormat() const { return format; }
+    inline bool IsValid() const { return width > 0 && height > 0; }
+    inline bool IsLab() const { return lab.Size() > 0; }
+    inline bool IsIndexed() const { return !palette.empty() && !pixels.empty(); }
+    //Streamed images only keep samples, they have no pixels to get.
+    inline bool IsSampled() const { return !samples.empty(); }
+    //Colors with pixel counts the quantizers use in place of pixels. Animated gif only keep this.
+    inline bool HasPalette() const { return !palette.empty(); }
+    //Frames merged from an animated gif, 0 for still images.
+    inline uint32_t GetFrameCount() const { return frameCount; }
+    inline size_t GetFileSize() const { return fileSize; }
+    //How much of the file the decoder went through, less than the file size when a preview stopped early.
+    inline size_t GetParsedBytes() const { return parsedBytes; }
+    //Whether rows were decoded a band or a row at a time, baseline jpeg with ImageOptions::outOfCore and
+    //QOI, farbfeld and PNM. Anything else held the whole image while decoding. Cached samples count as banded.
+    inline bool IsBanded() const { return banded; }
+    //RGB8 pixels, palette indices for indexed images, nullptr for images decoded to OkLab.
+    inline unsigned char* GetData() { return pixels.empty() ? nullptr : pixels.data(); }
+    //RGB16 pixels, nullptr for other formats.
+    inline uint16_t* GetData16() { return pixels16.empty() ? nullptr : pixels16.data(); }
+    //LinearF pixels, nullptr for other formats.
+    inline float* GetDataLinear() { return linear.empty() ? nullptr : linear.data(); }
+    inline const LabPlanes& GetLabPlanes() const { return lab; }
+    //Palette of an indexed image or colors of an animated gif, with the number of pixels using each entry.
+    inline const std::vector<PaletteEntry>& GetPalette() const { return palette; }
+    inline const std::vector<Lab>& GetSamples() const { return samples; }
+    //View over RGB8 pixels, invalid for images kept in any other form.
+    inline ImageView GetView() const {
+        if (format != PixelFormat::RGB8 || IsIndexed() || pixels.empty())
+            return ImageView{};
+        return ImageView{ pixels.data(), width, height, 0, ViewFormat::RGB8 };
+    }
+
+    //Largest mip level of the RGB8 pixels with at most maxPixels pixels, the image itself when it fits.
+    //Each level is a 2x2 box filter of the one above in linear light, built the first time it is asked for.
+    //Invalid for images without an RGB8 view.
+    ImageView GetMipLevel(size_t maxPixels);
+
+    //Mip level CollectSamples takes every pixel of with ImageOptions::mipSamples, the largest within a stride of 8.
+    //Crops of it sample a part of the image the same way as the whole. Invalid for images without an RGB8 view.
+    inline ImageView GetSampleLevel() { return GetMipLevel((size_t)width * height / 8); }
+    inline bool UsesMipSamples() const { return mipSamples; }
+
+    //OkLab samples the quantizers work on when there is no palette: the streamed samples, every pixel of
+    //GetSampleLevel with mipSamples, or every 8th pixel.
+    //Converted in bulk into planes.
+    LabPlanes CollectSamples();
 
-    inline RGB GetPixelRGB(uint32_t idx) const {
+    //Same samples in fixed point, converted a chunk at a time without float planes of all of them.
+    std::vector<Lab16> CollectCompactSamples();
+
+    inline RGB GetPixelRGB(size_t idx) const {
+        if (IsIndexed())
+            return palette[pixels[idx]].rgb;
+        if (IsLab())
+            return ColorTo<RGB>(GetPixelLab(idx));
+        if (format == PixelFormat::RGB16) {
+            return RGB{
+                ((float)pixels16[idx * 3] / 65535.0f),
+                ((float)pixels16[idx * 3 + 1] / 65535.0f),
+                ((float)pixels16[idx * 3 + 2] / 65535.0f)
+            };
+        }
+        if (format == PixelFormat::LinearF) {
+            return RGB{
+                LinearToGamma(std::clamp(linear[idx * 3], 0.0f, 1.0f)),
+                LinearToGamma(std::clamp(linear[idx * 3 + 1], 0.0f, 1.0f)),
+                LinearToGamma(std::clamp(linear[idx * 3 + 2], 0.0f, 1.0f))
+            };
+        }
         return RGB{
-            ((float)data[idx * 3] / 255.0f),
-            ((float)data[idx * 3 + 1] / 255.0f),
-            ((float)data[idx * 3 + 2] / 255.0f)
+            ((float)pixels[idx * 3] / 255.0f),
+            ((float)pixels[idx * 3 + 1] / 255.0f),
+            ((float)pixels[idx * 3 + 2] / 255.0f)
         };
     }
 
-    inline Lab GetPixelLab(uint32_t idx) const {
-        return ColorTo<Lab>(GetPixelRGB(idx));
+    inline Lab GetPixelLab(size_t idx) const {
+        if (IsIndexed())
+            return palette[pixels[idx]].lab;
+        if (IsLab())
+            return Lab{ lab.L[idx], lab.a[idx], lab.b[idx] };
+        Lab color{};
+        if (format == PixelFormat::RGB16)
+            RGB16RowToLab(&pixels16[idx * 3], 1, 3, &color.L, &color.a, &color.b);
+        else if (format == PixelFormat::LinearF)
+            LinearRowToLab(&linear[idx * 3], 1, 3, &color.L, &color.a, &color.b);
+        else
+            color = ColorTo<Lab>(RGB8{ pixels[idx * 3], pixels[idx * 3 + 1], pixels[idx * 3 + 2] });
+        return color;
     }
 
-    inline LCh GetPixelLCh(uint32_t idx) const {
+    inline LCh GetPixelLCh(size_t idx) const {
         return ColorTo<LCh>(GetPixelLab(idx));
     }
 
     static std::shared_ptr<Image> Open(const char* filename);
+    static std::shared_ptr<Image> Open(const char* filename, const ImageOptions& options);
+
+    //Size of an image from its header, without decoding it. False for stdin, it can only be read once.
+    static bool ReadSize(const char* filename, int& width, int& height);
+
+private:
+    struct RowDecoder;
+    struct FrameMerger;
+    struct CacheKey;
+    struct CacheHeader;
+
+    struct MipLevel {
+        int width = 0;
+        int height = 0;
+        std::vector<unsigned char> pixels{};
+    };
+
+    //Empty image for LoadCache to fill.
+    Image() = default;
+
+    //Decode an image, or read it back from the sample cache and store it there when options.cache is set.
+    static std::shared_ptr<Image> Load(const char* filename, const ImageOptions& options);
+
+    //Fill the samples or palette from the cache entry of filename, false when there is no valid one.
+    bool LoadCache(const char* filename, const ImageOptions& options);
+
+    //Keep only what the quantizers use, the palette or CollectSamples, and write it to the cache.
+    void StoreCache(const char* filename, const ImageOptions& options);
+
+    //Pick the smallest jpeg scale that still keeps at least maxPixels pixels.
+    static uint32_t GetJpegScaleForBudget(int width, int height, uint32_t maxPixels);
+
+    //Number of samples CollectSamples returns and count of them from sample first into L, a and b.
+    size_t GetSampleCount();
+    void GetSamplesLab(size_t first, size_t count, float* L, float* a, float* b);
+
+    //Store one final RGB8 row, converting it if the image is kept as OkLab.
+    void StoreRow(const unsigned char* row, int y);
+
+    //Store one final row of a YCbCr jpeg kept as OkLab, converted from the planes without an RGB8 row.
+    void StoreYCbCrRow(const unsigned char* luma, const unsigned char* cb, const unsigned char* cr, int y);
+
+    //Keep the indices stb returned, count them and convert only the palette entries.
+    void StoreIndexed(const unsigned char* indices, const unsigned char* rgba, int paletteSize);
+
+    //Merge the frames of an animated gif, false for anything with a single frame.
+    bool LoadFrames(const unsigned char* data, int size, const ImageOptions& options);
+
+    //Load farbfeld and 16 bit PNM without cutting them to 8 bit, false for other images.
+    bool LoadNativeWide(const NativeDecoder& native, const ImageOptions& options);
+
+    //Load 16 bit and hdr sources without going through 8 bit, false for other images.
+    bool LoadWide(const unsigned char* data, int size, const ImageOptions& options);
+
+    //Keep wide pixels as they are, or turn them into samples or OkLab planes, box-filtered down to maxPixels first.
+    template<typename T>
+    void StoreWide(const T* data, const ImageOptions& options, std::vector<T>& storage);
 
 private:
     int width = 0;
     int height = 0;
     int channels = 0;
-    unsigned char* data = nullptr;
-};
\ No newline at end of file
+    PixelFormat format = PixelFormat::RGB8;
+    size_t fileSize = 0;
+    size_t parsedBytes = 0;
+    uint32_t frameCount = 0;
+    std::vector<unsigned char> pixels{};
+    std::vector<uint16_t> pixels16{};
+    std::vector<float> linear{};
+    LabPlanes lab{};
+    std::vector<PaletteEntry> palette{};
+    std::vector<Lab> samples{};
+    std::vector<MipLevel> mips{}; //Half the size of the image, then half of that...
+    bool mipSamples = false;
+    bool banded = false;
+};
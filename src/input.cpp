@@ -0,0 +1,77 @@
+#include "input.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+InputFile::InputFile(const char* filename) {
+    bool isStdin = strcmp(filename, "-") == 0;
+    int fd = isStdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        if (!Map(fd, (size_t)info.st_size))
+            Read(fd);
+    } else {
+        Read(fd);
+    }
+
+    if (!isStdin)
+        close(fd);
+}
+
+InputFile::~InputFile() {
+    if (mapped)
+        munmap((void*)data, size);
+}
+
+bool InputFile::Map(int fd, size_t fileSize) {
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    void* ptr = mmap(nullptr, fileSize, PROT_READ, flags, fd, 0);
+    if (ptr == MAP_FAILED)
+        return false;
+    //Decoders walk the file front to back, let the kernel read ahead aggressively.
+    madvise(ptr, fileSize, MADV_SEQUENTIAL);
+
+    data = (const unsigned char*)ptr;
+    size = fileSize;
+    mapped = true;
+    return true;
+}
+
+bool InputFile::Read(int fd) {
+    size_t capacity = 1 << 16;
+    size_t used = 0;
+    buffer.resize(capacity);
+
+    while (true) {
+        if (used == capacity) {
+            capacity *= 2;
+            buffer.resize(capacity);
+        }
+        ssize_t count = read(fd, buffer.data() + used, capacity - used);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0)
+            return false;
+        if (count == 0)
+            break;
+        used += (size_t)count;
+    }
+
+    if (used == 0)
+        return false;
+    buffer.resize(used);
+    data = buffer.data();
+    size = used;
+    return true;
+}
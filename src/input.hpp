@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+
+//Read-only bytes of an input file. Regular files are memory mapped,
+//anything else (stdin, pipes) is read once into a buffer. "-" is stdin.
+class InputFile {
+public:
+    InputFile() = delete;
+    InputFile(const char* filename);
+    InputFile(const InputFile&) = delete;
+    InputFile& operator=(const InputFile&) = delete;
+    ~InputFile();
+
+    inline const unsigned char* GetData() const { return data; }
+    inline size_t GetSize() const { return size; }
+    inline bool IsValid() const { return data != nullptr; }
+
+private:
+    bool Map(int fd, size_t fileSize);
+    bool Read(int fd);
+
+private:
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<unsigned char> buffer{};
+};
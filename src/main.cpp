@@ -22,8 +22,77 @@ struct Options {
     bool print = true;
     std::vector<std::pair<std::string, std::string>> templates{};
     unsigned int seed = 0;
+    ImageOptions image{};
+    bool compactSamples = false; //Quantize 16 bit fixed point samples instead of float ones.
+    uint32_t labLut = 0; //Points per side of the LabLUT 8 bit sRGB is converted through. (0 converts exactly)
+    ColorKernel colorKernel = GetBestColorKernel(); //Instruction set of the batch color conversions.
+    std::vector<std::pair<uint32_t, uint32_t>> screens{};
+    enum class FillMode {
+        Fill, //Scaled to cover the screen, the overflow is cropped.
+        Fit, //Scaled to fit inside the screen, all of it shows.
+        Center, //Unscaled and centered.
+        Tile //Unscaled and repeated from the top left corner.
+    } fill = FillMode::Fill;
 };
 
+//Part of an image shown on a screen, in fractions of the image size.
+struct Region {
+    float x;
+    float y;
+    float width;
+    float height;
+};
+
+//Scale the image is shown at on a width x height screen.
+float GetDisplayScale(int width, int height, std::pair<uint32_t, uint32_t> screen, Options::FillMode fill) {
+    float scaleX = (float)screen.first / (float)width;
+    float scaleY = (float)screen.second / (float)height;
+    switch (fill) {
+        case Options::FillMode::Fill:
+            return std::max(scaleX, scaleY);
+        case Options::FillMode::Fit:
+            return std::min(scaleX, scaleY);
+        default:
+            return 1.0f;
+    }
+}
+
+Region GetVisibleRegion(int width, int height, std::pair<uint32_t, uint32_t> screen, Options::FillMode fill) {
+    float scale = GetDisplayScale(width, height, screen, fill);
+    float visibleWidth = std::min(1.0f, (float)screen.first / (scale * (float)width));
+    float visibleHeight = std::min(1.0f, (float)screen.second / (scale * (float)height));
+    if (fill == Options::FillMode::Tile)
+        return Region{ 0.0f, 0.0f, visibleWidth, visibleHeight };
+    return Region{ (1.0f - visibleWidth) / 2.0f, (1.0f - visibleHeight) / 2.0f, visibleWidth, visibleHeight };
+}
+
+//Parse "WxH[,WxH...]".
+bool ParseScreens(const char* arg, std::vector<std::pair<uint32_t, uint32_t>>& screens) {
+    std::string list = arg;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string screen = list.substr(start, end - start);
+        size_t separator = screen.find('x');
+        if (separator == std::string::npos)
+            return false;
+        try {
+            size_t widthEnd, heightEnd;
+            uint32_t width = std::stoul(screen.substr(0, separator), &widthEnd);
+            uint32_t height = std::stoul(screen.substr(separator + 1), &heightEnd);
+            if (widthEnd != separator || heightEnd != screen.size() - separator - 1 || width == 0 || height == 0)
+                return false;
+            screens.push_back({ width, height });
+        } catch (std::exception& e) {
+            return false;
+        }
+        start = end + 1;
+    }
+    return !screens.empty();
+}
+
 bool FileExists(const char* path) {
     struct stat buffer;
     return (stat(path, &buffer) == 0);
@@ -41,7 +110,7 @@ bool GetOptions(int argc, const char** argv, Options& options) {
         if (strcmp(argv[idx], "-h") == 0 || strcmp(argv[idx], "--help") == 0) {
             std::cout << 
             "\n-h, --help: show this help message." 
-            "\n-i, --input <image>: input image to be used to generate a color palette."
+            "\n-i, --input <image>: input image to be used to generate a color palette. use - to read it from stdin."
             "\n-q, --quantizer <median-cut/k-mean>: set wich quantizer to use. (Default is median cut)"
             "\n-t, --template <template file> <output file>: add a template to be rendered. this argument is repeatable." 
             "\n-s, --silent: make the app not print anything in the console except for error."
@@ -49,7 +118,27 @@ bool GetOptions(int argc, const char** argv, Options& options) {
             "\n--dark: generate a dark theme. (Default)"
             "\n--light: generate a light theme."
             "\n--luminosity <value>: set theme overall luminosity between 0 and 100." 
-            "\n--seed <value>: set quantizer seed (this has no effect with median cut)."<< std::endl;
+            "\n--seed <value>: set quantizer and sampler seed (this has no effect with median cut and the stride sampler)."
+            "\n--max-pixels <count>: downscale the image until it fits in this many pixels before quantizing. (Default is 0, no limit)"
+            "\n--jpeg-scale <1/2/4/8>: decode jpeg images at a fraction of their size, 8 only uses the DC coefficients. (Default picks one from --max-pixels)"
+            "\n--decode-lab: convert pixels to OkLab while decoding instead of keeping them as RGB."
+            "\n--mip-samples: sample every pixel of a linear light mip level of the image instead of every 8th pixel, patterns and stripes don't alias."
+            "\n--compact-samples: quantize samples as 6 byte fixed point OkLab instead of 12 byte floats, half the memory for a near identical palette."
+            "\n--simd <scalar/sse2/avx2/avx512>: instruction set of the batch color conversions, scalar is the exact libm one. (Default is the widest the cpu has)"
+            "\n--lab-lut <size>: convert 8 bit pixels to OkLab by interpolating a size^3 table (2 to 256) instead of exactly, 65 is off by less than 5e-4. (Default is 0, exact)"
+            "\n--preview: only decode the first pass of interlaced png and the DC scans of progressive jpeg."
+            "\n--threads <count>: threads used to decode jpeg with restart markers. (Default is 0, every core)"
+            "\n--samples <count>: stream the image and only keep this many samples of it, rows are dropped once sampled. (Default is 0, keep the image)"
+            "\n--sampler <stride/reservoir/stratified>: how --samples picks pixels. (Default is stride)"
+            "\n--frame-step <n>: merge every n-th frame of animated gif, reservoir sampled with --samples. (Default is 1, 0 only uses the first frame)"
+            "\n--keyframes: only merge the animated gif frames that redraw the whole canvas."
+            "\n--out-of-core: decode baseline jpeg a band of rows at a time (QOI, farbfeld and PNM a row at a time) and only keep a color histogram (or the --samples), memory stays bounded whatever the image size."
+            " The histogram has a cell per 15 bit RGB color, colors less than a cell apart are merged so the palette is close to, not the same as, the one from the pixels."
+            " Other images are decoded whole, with a warning."
+            "\n--screen <WxH[,WxH...]>: only quantize what these screens show of the image, decoded no larger than they show it. Needs 8 bit pixels, other images fail."
+            "\n--fill <fill/fit/center/tile>: how --screen shows the image. (Default is fill)"
+            "\n--prefer-thumbnail: quantize the x-large or large freedesktop thumbnail of the image when it is still valid, the image itself otherwise."
+            "\n--cache: keep the samples quantized from the image under $XDG_CACHE_HOME/lain and reuse them while the file and these options don't change."<< std::endl;
             return false;
         }
 
@@ -161,6 +250,7 @@ bool GetOptions(int argc, const char** argv, Options& options) {
             }
             try {
                 options.seed = std::stoi(argv[idx]);
+                options.image.seed = options.seed;
             } catch (std::exception& e) {
                 std::cout << "Invalid value for --seed" << std::endl;
                 return false;
@@ -169,6 +259,247 @@ bool GetOptions(int argc, const char** argv, Options& options) {
             continue;
         }
 
+        if (strcmp(argv[idx], "--max-pixels") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --max-pixels." << std::endl;
+                return false;
+            }
+            try {
+                options.image.maxPixels = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --max-pixels" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--jpeg-scale") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --jpeg-scale." << std::endl;
+                return false;
+            }
+            try {
+                options.image.jpegScale = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --jpeg-scale" << std::endl;
+                return false;
+            }
+            if (options.image.jpegScale != 1 && options.image.jpegScale != 2 && options.image.jpegScale != 4 && options.image.jpegScale != 8) {
+                std::cout << "Invalid value for --jpeg-scale" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--threads") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --threads." << std::endl;
+                return false;
+            }
+            try {
+                options.image.threads = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --threads" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--samples") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --samples." << std::endl;
+                return false;
+            }
+            try {
+                options.image.samples = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --samples" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--sampler") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing sampler for --sampler." << std::endl;
+                return false;
+            }
+            if (strcmp(argv[idx], "stride") == 0) {
+                options.image.sampler = SampleMode::Stride;
+            }
+            else if (strcmp(argv[idx], "reservoir") == 0) {
+                options.image.sampler = SampleMode::Reservoir;
+            }
+            else if (strcmp(argv[idx], "stratified") == 0) {
+                options.image.sampler = SampleMode::Stratified;
+            }
+            else {
+                std::cout << "Invalid input for --sampler." << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--screen") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing size for --screen." << std::endl;
+                return false;
+            }
+            if (!ParseScreens(argv[idx], options.screens)) {
+                std::cout << "Invalid input for --screen." << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--fill") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing mode for --fill." << std::endl;
+                return false;
+            }
+            if (strcmp(argv[idx], "fill") == 0) {
+                options.fill = Options::FillMode::Fill;
+            }
+            else if (strcmp(argv[idx], "fit") == 0) {
+                options.fill = Options::FillMode::Fit;
+            }
+            else if (strcmp(argv[idx], "center") == 0) {
+                options.fill = Options::FillMode::Center;
+            }
+            else if (strcmp(argv[idx], "tile") == 0) {
+                options.fill = Options::FillMode::Tile;
+            }
+            else {
+                std::cout << "Invalid input for --fill." << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--frame-step") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --frame-step." << std::endl;
+                return false;
+            }
+            try {
+                options.image.frameStep = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --frame-step" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--keyframes") == 0) {
+            options.image.keyframes = true;
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--preview") == 0) {
+            ++idx;
+            options.image.preview = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--out-of-core") == 0) {
+            ++idx;
+            options.image.outOfCore = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--prefer-thumbnail") == 0) {
+            ++idx;
+            options.image.preferThumbnail = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--cache") == 0) {
+            ++idx;
+            options.image.cache = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--decode-lab") == 0) {
+            ++idx;
+            options.image.lab = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--mip-samples") == 0) {
+            ++idx;
+            options.image.mipSamples = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--compact-samples") == 0) {
+            ++idx;
+            options.compactSamples = true;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--simd") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing instruction set for --simd." << std::endl;
+                return false;
+            }
+            if (strcmp(argv[idx], "scalar") == 0) {
+                options.colorKernel = ColorKernel::Scalar;
+            }
+            else if (strcmp(argv[idx], "sse2") == 0) {
+                options.colorKernel = ColorKernel::SSE2;
+            }
+            else if (strcmp(argv[idx], "avx2") == 0) {
+                options.colorKernel = ColorKernel::AVX2;
+            }
+            else if (strcmp(argv[idx], "avx512") == 0) {
+                options.colorKernel = ColorKernel::AVX512;
+            }
+            else {
+                std::cout << "Invalid input for --simd." << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
+        if (strcmp(argv[idx], "--lab-lut") == 0) {
+            ++idx;
+            if (idx >= argc) {
+                std::cout << "Missing value for --lab-lut." << std::endl;
+                return false;
+            }
+            try {
+                options.labLut = std::stoul(argv[idx]);
+            } catch (std::exception& e) {
+                std::cout << "Invalid value for --lab-lut" << std::endl;
+                return false;
+            }
+            if (options.labLut == 1 || options.labLut > 256) {
+                std::cout << "Invalid value for --lab-lut" << std::endl;
+                return false;
+            }
+            ++idx;
+            continue;
+        }
+
         if (strcmp(argv[idx], "-s") == 0 || strcmp(argv[idx], "--silent") == 0) {
             ++idx;
             options.print = false;
@@ -214,13 +545,39 @@ int main(int argc, const char** argv) {
         return -1;
     }
 
-    std::shared_ptr<Image> img = Image::Open(options.inputFile);
+    SetColorKernel(options.colorKernel);
+    SetLabLUTSize(options.labLut);
+
+    //Decode no larger than the biggest screen shows the image. Regions are computed on the
+    //source size, the decoded image may be smaller.
+    int sourceWidth = 0;
+    int sourceHeight = 0;
+    if (!options.screens.empty()) {
+        //Palette indices and cached samples have no view to crop.
+        options.image.palette = false;
+        options.image.cache = false;
+        if (Image::ReadSize(options.inputFile, sourceWidth, sourceHeight) && options.image.maxPixels == 0 && options.image.jpegScale == 0) {
+            float scale = 0.0f;
+            for (const auto& screen : options.screens)
+                scale = std::max(scale, GetDisplayScale(sourceWidth, sourceHeight, screen, options.fill));
+            if (scale < 1.0f)
+                options.image.maxPixels = (uint32_t)std::min(ceil((double)sourceWidth * sourceHeight * scale * scale), (double)UINT32_MAX);
+        }
+    }
+
+    std::shared_ptr<Image> img = Image::Open(options.inputFile, options.image);
 
-    if (!img->GetData()) {
+    if (!img->IsValid()) {
         std::cout << "Failed to open \"" << options.inputFile << "\"." << std::endl;
         return -1;
     }
 
+    if (options.image.outOfCore && !img->IsBanded())
+        std::cout << "Warning: \"" << options.inputFile << "\" can't be decoded a band of rows at a time, --out-of-core only bounded what is kept after decoding it whole." << std::endl;
+
+    if (options.print && options.image.preview)
+        std::cout << "Preview parsed " << img->GetParsedBytes() << " of " << img->GetFileSize() << " bytes (" << img->GetWidth() << "x" << img->GetHeight() << ")." << std::endl;
+
     std::shared_ptr<Quantizer> quantizer = nullptr;
 
     switch (options.quantizer) {
@@ -238,9 +595,40 @@ int main(int argc, const char** argv) {
             quantizer = std::make_shared<MedianCut>();
             break;
     }
+    quantizer->SetCompactSamples(options.compactSamples);
+
+    //Regions are cropped out of what the whole image would be sampled from, the mip level with --mip-samples,
+    //so a crop of the whole image gives the same theme. Streamed, OkLab, wide and merged gif images have no
+    //RGB8 view to crop, quantizing them whole would not be what the screens show.
+    std::vector<ImageView> views{};
+    ImageView view = img->UsesMipSamples() ? img->GetSampleLevel() : img->GetView();
+    if (!options.screens.empty() && !view.IsValid()) {
+        std::cout << "--screen can't crop \"" << options.inputFile << "\", it has no 8 bit pixels. (16 bit, hdr and animated images, --samples, --decode-lab and --out-of-core)" << std::endl;
+        return -1;
+    }
+    if (!options.screens.empty()) {
+        if (sourceWidth == 0) {
+            sourceWidth = img->GetWidth();
+            sourceHeight = img->GetHeight();
+        }
+        for (const auto& screen : options.screens) {
+            Region region = GetVisibleRegion(sourceWidth, sourceHeight, screen, options.fill);
+            int left = (int)floorf(region.x * view.GetWidth());
+            int top = (int)floorf(region.y * view.GetHeight());
+            int right = (int)ceilf((region.x + region.width) * view.GetWidth());
+            int bottom = (int)ceilf((region.y + region.height) * view.GetHeight());
+            views.push_back(view.Crop(left, top, right - left, bottom - top));
+        }
+    }
 
     std::vector<Lab> palette( options.paletteSize );
-    quantizer->Quantize(img, palette.data(), palette.size());
+    if (!views.empty()) {
+        if (img->UsesMipSamples())
+            quantizer->SetViewStride(1);
+        quantizer->Quantize(views, palette.data(), palette.size());
+    }
+    else
+        quantizer->Quantize(img, palette.data(), palette.size());
 
     ThemeMaker maker{};
     ThemeRGB theme = maker.Make(img, palette.data(), palette.size(), options.themeLuminosity);
@@ -1,23 +1,114 @@
 #include "quantizer.hpp"
 #include <algorithm>
+#include <limits>
 #include <vector>
 #include <iostream>
 
-void MedianCut::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) {
-    size_t d = 8;
-    std::vector<Lab> data( (size_t)(img->GetWidth() * img->GetHeight()) / d );
-    for (size_t i = 0; i < data.size(); ++i)
-        data[i] = img->GetPixelLab(i * d);
+LabPlanes Quantizer::GetViewSamples(const std::vector<ImageView>& views) const {
+    size_t d = viewStride;
+    size_t total = 0;
+    for (const ImageView& view : views)
+        total += view.GetSampleCount(d);
+
+    LabPlanes samples{};
+    samples.Resize(total);
+    size_t offset = 0;
+    for (const ImageView& view : views)
+        offset += view.GetSamplesLab(d, &samples.L[offset], &samples.a[offset], &samples.b[offset]);
+    return samples;
+}
+
+std::vector<Lab16> Quantizer::GetCompactViewSamples(const std::vector<ImageView>& views) const {
+    size_t d = viewStride;
+    size_t total = 0;
+    for (const ImageView& view : views)
+        total += view.GetSampleCount(d);
+
+    std::vector<Lab16> samples(total);
+    size_t offset = 0;
+    for (const ImageView& view : views) {
+        ConvertToLab16(view.GetSampleCount(d), &samples[offset], [&view, d](size_t first, size_t count, float* L, float* a, float* b) {
+            view.GetSamplesLab(d, first, count, L, a, b);
+        });
+        offset += view.GetSampleCount(d);
+    }
+    return samples;
+}
+
+//Channel i of a sample, the median cut works the same on both kinds.
+static inline float GetChannel(const Lab& color, uint32_t i) {
+    return ((const float*)&color.L)[i];
+}
+
+static inline int32_t GetChannel(const Lab16& color, uint32_t i) {
+    return ((const int16_t*)&color.L)[i];
+}
+
+static Lab GetAverage(const Lab* start, const Lab* end) {
+    Lab c{ 0.0f, 0.0f, 0.0f };
+    for (const Lab* it = start; it < end; ++it) {
+        c.L += it->L;
+        c.a += it->a;
+        c.b += it->b;
+    }
+    float bucketSize = (float)(end - start);
+    return Lab{ c.L / (float)bucketSize, c.a / (float)bucketSize, c.b / (float)bucketSize };
+}
+
+static Lab GetAverage(const Lab16* start, const Lab16* end) {
+    int64_t L = 0, a = 0, b = 0;
+    for (const Lab16* it = start; it < end; ++it) {
+        L += it->L;
+        a += it->a;
+        b += it->b;
+    }
+    float scale = Lab16Scale * (float)(end - start);
+    return Lab{ (float)L / scale, (float)a / scale, (float)b / scale };
+}
+
+//Channel with the largest range over the samples, and that range.
+template<typename T>
+static uint32_t GetChannelMaxRange(const T* start, const T* end, float* largestChannelDiff) {
+    typedef decltype(GetChannel(*start, 0)) Value;
+    Value min[3] = { std::numeric_limits<Value>::max(), std::numeric_limits<Value>::max(), std::numeric_limits<Value>::max() };
+    Value max[3] = { std::numeric_limits<Value>::lowest(), std::numeric_limits<Value>::lowest(), std::numeric_limits<Value>::lowest() };
+
+    for (const T* it = start; it < end; ++it) {
+        for (uint32_t j = 0; j < 3; ++j) {
+            Value currentChannelValue = GetChannel(*it, j);
+            if (currentChannelValue < min[j])
+                min[j] = currentChannelValue;
+            if (currentChannelValue > max[j])
+                max[j] = currentChannelValue;
+        }
+    }
+
+    uint32_t largestRangeChannelIndex = 0;
+    float largestRangeChannelDiff = 0.0f;
+
+    for (uint32_t i = 0; i < 3; ++i) {
+        float currentChannelDiff = (float)(max[i] - min[i]);
+        if (currentChannelDiff > largestRangeChannelDiff) {
+            largestRangeChannelIndex = i;
+            largestRangeChannelDiff = currentChannelDiff;
+        }
+    }
+    *largestChannelDiff = largestRangeChannelDiff;
+    return largestRangeChannelIndex;
+}
 
+//Median cut over samples of either kind, reordered in place.
+template<typename T>
+static void MedianCutSamples(T* data, size_t count, Lab* colors, uint32_t size) {
     struct BucketRange {
-        Lab* start;
-        Lab* end;
+        T* start;
+        T* end;
     };
 
     uint32_t bucketsCount = 1;
     std::vector<BucketRange> bucketsRange( (size_t)size );
-    bucketsRange[0].start = &data[0];
-    bucketsRange[0].end = &data[0] + data.size();
+    bucketsRange[0].start = data;
+    bucketsRange[0].end = data + count;
 
     while (bucketsCount < size) {
         uint32_t bucketIndex = 0;
@@ -28,7 +119,7 @@ void MedianCut::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size)
             if (bucketsRange[i].end - bucketsRange[i].start < 16)
                 continue;
             float largestRangeChannelDiff;
-            uint32_t currentLargestRangeChannelIndex = GetChannelMaxRange((float*)bucketsRange[i].start, (float*)bucketsRange[i].end, 3, &largestRangeChannelDiff);
+            uint32_t currentLargestRangeChannelIndex = GetChannelMaxRange(bucketsRange[i].start, bucketsRange[i].end, &largestRangeChannelDiff);
             if (largestRangeChannelDiff > bucketLargestRangeChannelDiff) {
                 bucketLargestRangeChannelDiff = largestRangeChannelDiff;
                 bucketIndex = i;
@@ -36,18 +127,14 @@ void MedianCut::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size)
             }
         }
 
-        Lab* start = bucketsRange[bucketIndex].start;
-        Lab* end = bucketsRange[bucketIndex].end;
-        Lab* mid = start + (end - start) / 2;
+        T* start = bucketsRange[bucketIndex].start;
+        T* end = bucketsRange[bucketIndex].end;
+        T* mid = start + (end - start) / 2;
 
-        std::sort(start, end, [&](const Lab& a, const Lab& b) {
-            return ((float*)&a.L)[bucketLargestRangeChannelIndex] < ((float*)&b.L)[bucketLargestRangeChannelIndex];
+        std::sort(start, end, [&](const T& a, const T& b) {
+            return GetChannel(a, bucketLargestRangeChannelIndex) < GetChannel(b, bucketLargestRangeChannelIndex);
         });
 
-        float midValue = ((float*)mid)[bucketLargestRangeChannelIndex];
-        Lab* newBucketStart = start;
-        for (; ((float*)newBucketStart)[bucketLargestRangeChannelIndex] < midValue; ++newBucketStart) {}
-
         bucketsRange[bucketIndex].start = start;
         bucketsRange[bucketIndex].end = mid;
         bucketsRange[bucketsCount].start = mid + 1;
@@ -55,90 +142,274 @@ void MedianCut::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size)
         ++bucketsCount;
     }
 
-    for (uint32_t i = 0; i < size; ++i) {
-        Lab* start = bucketsRange[i].start;
-        Lab* end = bucketsRange[i].end;
-        Lab c{ 0.0f, 0.0f, 0.0f };
-        for (Lab* it = start; it < end; ++it) {
-            c.L += it->L;
-            c.a += it->a;
-            c.b += it->b;
-        }
-        float bucketSize = (float)(end - start);
-        colors[i] = Lab{ c.L / (float)bucketSize, c.a / (float)bucketSize, c.b / (float)bucketSize };
-    }
+    for (uint32_t i = 0; i < size; ++i)
+        colors[i] = GetAverage(bucketsRange[i].start, bucketsRange[i].end);
 
     std::sort(colors, colors + size, [&](const Lab& a, const Lab& b) {
         return a.L < b.L;
     });
 }
 
-uint32_t MedianCut::GetChannelMaxRange(float* start, float* end, uint32_t channelCount, float* largestChannelDiff) {
-    struct MinMax {
-        float min = 1000.0f;
-        float max = -1000.0f;
+void MedianCut::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) {
+    if (img->HasPalette()) {
+        QuantizePalette(img->GetPalette(), colors, size);
+        return;
+    }
+    if (compact) {
+        std::vector<Lab16> samples = img->CollectCompactSamples();
+        QuantizeCompact(samples, colors, size);
+        return;
+    }
+    QuantizeSamples(img->CollectSamples(), colors, size);
+}
+
+void MedianCut::Quantize(const ImageView& view, Lab* colors, uint32_t size) {
+    Quantize(std::vector<ImageView>{ view }, colors, size);
+}
+
+void MedianCut::Quantize(const std::vector<ImageView>& views, Lab* colors, uint32_t size) {
+    if (compact) {
+        std::vector<Lab16> samples = GetCompactViewSamples(views);
+        QuantizeCompact(samples, colors, size);
+        return;
+    }
+    QuantizeSamples(GetViewSamples(views), colors, size);
+}
+
+void MedianCut::QuantizeSamples(const LabPlanes& samples, Lab* colors, uint32_t size) {
+    //Buckets are sorted whole colors at a time, the planes are interleaved once into the array they reorder.
+    std::vector<Lab> data(samples.Size());
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = Lab{ samples.L[i], samples.a[i], samples.b[i] };
+    MedianCutSamples(data.data(), data.size(), colors, size);
+}
+
+void MedianCut::QuantizeCompact(std::vector<Lab16>& samples, Lab* colors, uint32_t size) {
+    MedianCutSamples(samples.data(), samples.size(), colors, size);
+}
+
+void MedianCut::QuantizePalette(const std::vector<PaletteEntry>& palette, Lab* colors, uint32_t size) {
+    std::vector<PaletteEntry> entries{};
+    for (const PaletteEntry& entry : palette) {
+        if (entry.count > 0)
+            entries.push_back(entry);
+    }
+
+    struct BucketRange {
+        PaletteEntry* start;
+        PaletteEntry* end;
     };
 
-    std::vector<MinMax> channelsMinMax( (size_t)channelCount );
+    uint32_t bucketsCount = 1;
+    std::vector<BucketRange> bucketsRange( (size_t)size );
+    bucketsRange[0].start = entries.data();
+    bucketsRange[0].end = entries.data() + entries.size();
+
+    while (bucketsCount < size) {
+        int32_t bucketIndex = -1;
+        float bucketLargestRangeChannelDiff = 0.0f;
+        uint32_t bucketLargestRangeChannelIndex = 0;
 
-    for (float* it = start; it < end; it += channelCount) {
-        for (uint32_t j = 0; j < channelCount; ++j) {
-            float currentChannelValue = it[j];
-            if (currentChannelValue < channelsMinMax[j].min)
-                channelsMinMax[j].min = currentChannelValue;
-            if (currentChannelValue > channelsMinMax[j].max)
-                channelsMinMax[j].max = currentChannelValue;
+        for (uint32_t i = 0; i < bucketsCount; ++i) {
+            if (bucketsRange[i].end - bucketsRange[i].start < 2)
+                continue;
+            for (uint32_t j = 0; j < 3; ++j) {
+                float min = 1000.0f;
+                float max = -1000.0f;
+                for (PaletteEntry* it = bucketsRange[i].start; it < bucketsRange[i].end; ++it) {
+                    min = std::min(min, ((float*)&it->lab.L)[j]);
+                    max = std::max(max, ((float*)&it->lab.L)[j]);
+                }
+                if (max - min > bucketLargestRangeChannelDiff) {
+                    bucketLargestRangeChannelDiff = max - min;
+                    bucketIndex = i;
+                    bucketLargestRangeChannelIndex = j;
+                }
+            }
         }
-    }
 
-    uint32_t largestRangeChannelIndex = 0;
-    float largestRangeChannelDiff = 0.0f;
+        //Every bucket is down to a single color.
+        if (bucketIndex < 0)
+            break;
 
-    for (uint32_t i = 0; i < channelCount; ++i) {
-        float currentChannelDiff = channelsMinMax[i].max - channelsMinMax[i].min;
-        if (currentChannelDiff > largestRangeChannelDiff) {
-            largestRangeChannelIndex = i;
-            largestRangeChannelDiff = currentChannelDiff;
+        PaletteEntry* start = bucketsRange[bucketIndex].start;
+        PaletteEntry* end = bucketsRange[bucketIndex].end;
+
+        std::sort(start, end, [&](const PaletteEntry& a, const PaletteEntry& b) {
+            return ((float*)&a.lab.L)[bucketLargestRangeChannelIndex] < ((float*)&b.lab.L)[bucketLargestRangeChannelIndex];
+        });
+
+        //Split at the weighted median, keeping at least one entry on each side.
+        uint64_t total = 0;
+        for (PaletteEntry* it = start; it < end; ++it)
+            total += it->count;
+        uint64_t sum = 0;
+        PaletteEntry* mid = start;
+        while (mid < end - 1 && (sum + mid->count) * 2 <= total)
+            sum += (mid++)->count;
+        if (mid == start)
+            ++mid;
+
+        bucketsRange[bucketIndex].end = mid;
+        bucketsRange[bucketsCount].start = mid;
+        bucketsRange[bucketsCount].end = end;
+        ++bucketsCount;
+    }
+
+    for (uint32_t i = 0; i < size; ++i) {
+        //Images with fewer colors than asked for repeat them.
+        const BucketRange& bucket = bucketsRange[i % bucketsCount];
+        Lab c{ 0.0f, 0.0f, 0.0f };
+        float weight = 0.0f;
+        for (PaletteEntry* it = bucket.start; it < bucket.end; ++it) {
+            c.L += it->lab.L * it->count;
+            c.a += it->lab.a * it->count;
+            c.b += it->lab.b * it->count;
+            weight += it->count;
         }
+        if (weight <= 0.0f)
+            weight = 1.0f;
+        colors[i] = Lab{ c.L / weight, c.a / weight, c.b / weight };
     }
-    if (largestChannelDiff)
-        *largestChannelDiff = largestRangeChannelDiff;
-    return largestRangeChannelIndex;
+
+    std::sort(colors, colors + size, [&](const Lab& a, const Lab& b) {
+        return a.L < b.L;
+    });
 }
 
 void KMean::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) {
-    struct Point {
-        Lab position = { 0.0f, 0.0f, 0.0f };
-        int cluster = -1;
-        float minDist = 1000.0;
-
-        float GetDistance(Point p) {
-            return (p.position.L - position.L)* (p.position.L - position.L) + 
-                (p.position.a - position.a) * (p.position.a - position.a) + 
-                (p.position.b - position.b) * (p.position.b - position.b);
+    if (img->HasPalette()) {
+        //Cluster the palette, each entry standing for all the pixels using it.
+        std::vector<Point> points{};
+        std::vector<uint64_t> weights{};
+        for (const PaletteEntry& entry : img->GetPalette()) {
+            if (entry.count > 0) {
+                points.push_back(Point{ entry.lab });
+                weights.push_back(entry.count);
+            }
         }
+        QuantizePoints(points, weights, colors, size);
+        return;
+    }
+    if (compact) {
+        QuantizeCompact(img->CollectCompactSamples(), colors, size);
+        return;
+    }
+    QuantizeSamples(img->CollectSamples(), colors, size);
+}
+
+void KMean::Quantize(const ImageView& view, Lab* colors, uint32_t size) {
+    Quantize(std::vector<ImageView>{ view }, colors, size);
+}
+
+void KMean::Quantize(const std::vector<ImageView>& views, Lab* colors, uint32_t size) {
+    if (compact) {
+        QuantizeCompact(GetCompactViewSamples(views), colors, size);
+        return;
+    }
+    QuantizeSamples(GetViewSamples(views), colors, size);
+}
+
+void KMean::QuantizeSamples(const LabPlanes& samples, Lab* colors, uint32_t size) {
+    std::vector<Point> points(samples.Size());
+    for (size_t i = 0; i < points.size(); ++i)
+        points[i].position = Lab{ samples.L[i], samples.a[i], samples.b[i] };
+    QuantizePoints(points, std::vector<uint64_t>{}, colors, size);
+}
+
+void KMean::QuantizeCompact(const std::vector<Lab16>& samples, Lab* colors, uint32_t size) {
+    struct Cluster {
+        Lab16 centroid = {};
+        uint64_t pointsCount = 0;
+        int64_t sumL = 0;
+        int64_t sumA = 0;
+        int64_t sumB = 0;
     };
+
+    size_t epochs = 10;
+    if (samples.empty()) {
+        std::fill(colors, colors + size, Lab{ 0.0f, 0.0f, 0.0f });
+        return;
+    }
+
+    //Same seeds as QuantizePoints draws for samples of weight 1.
+    std::vector<Cluster> clusters(size);
+    srand(seed);
+    for (uint32_t i = 0; i < clusters.size(); ++i)
+        clusters[i].centroid = samples[(uint64_t)rand() % samples.size()];
+
+    for (uint32_t e = 0; e < epochs; ++e) {
+        for (const Lab16& sample : samples) {
+            uint32_t minDist = UINT32_MAX;
+            uint32_t cluster = 0;
+            for (uint32_t j = 0; j < clusters.size(); ++j) {
+                uint32_t dist = GetDistance16(sample, clusters[j].centroid);
+                if (minDist > dist) {
+                    minDist = dist;
+                    cluster = j;
+                }
+            }
+            clusters[cluster].pointsCount += 1;
+            clusters[cluster].sumL += sample.L;
+            clusters[cluster].sumA += sample.a;
+            clusters[cluster].sumB += sample.b;
+        }
+
+        for (uint32_t i = 0; i < clusters.size(); ++i) {
+            if (clusters[i].pointsCount <= 0) {
+                clusters[i].centroid = samples[(uint64_t)rand() % samples.size()];
+                continue;
+            }
+            double count = (double)clusters[i].pointsCount;
+            clusters[i].centroid = Lab16{
+                (int16_t)std::lround(clusters[i].sumL / count),
+                (int16_t)std::lround(clusters[i].sumA / count),
+                (int16_t)std::lround(clusters[i].sumB / count)
+            };
+            clusters[i] = Cluster{ clusters[i].centroid };
+        }
+    }
+
+    for (uint32_t i = 0; i < clusters.size(); ++i)
+        colors[i] = FromLab16(clusters[i].centroid);
+
+    std::sort(colors, colors + size, [&](const Lab& a, const Lab& b) {
+        return a.L < b.L;
+    });
+}
+
+void KMean::QuantizePoints(std::vector<Point>& points, const std::vector<uint64_t>& weights, Lab* colors, uint32_t size) {
     struct Cluster {
         Point centroid = {};
-        int pointsCount = 0;
+        uint64_t pointsCount = 0;
         Lab sumPosition = { 0.0f, 0.0f, 0.0f };
     };
 
     size_t epochs = 10;
-    size_t d = 8;
-    std::vector<Point> points( (size_t)(img->GetWidth() * img->GetHeight()) / d );
-    for (size_t i = 0; i < points.size(); ++i)
-        points[i].position = img->GetPixelLab(i * d);
-    
+
+    //Running weight so seeds are drawn per pixel, not per palette entry.
+    std::vector<uint64_t> weightSums(weights.size());
+    uint64_t totalWeight = 0;
+    for (size_t i = 0; i < weights.size(); ++i) {
+        totalWeight += weights[i];
+        weightSums[i] = totalWeight;
+    }
+    auto randomPoint = [&]() -> const Point& {
+        if (weights.empty())
+            return points[(uint64_t)rand() % points.size()];
+        uint64_t r = (uint64_t)rand() % totalWeight;
+        return points[std::upper_bound(weightSums.begin(), weightSums.end(), r) - weightSums.begin()];
+    };
+
     std::vector<Cluster> clusters(size);
     srand(seed);
 
     for (uint32_t i = 0; i < clusters.size(); ++i) {
-        clusters[i].centroid.position = points[rand() % points.size()].position;
+        clusters[i].centroid.position = randomPoint().position;
     }
 
     for (uint32_t e = 0; e < epochs; ++e) {
-        for (uint32_t i = 0; i < points.size(); ++i) {
+        for (size_t i = 0; i < points.size(); ++i) {
             for (uint32_t j = 0; j < clusters.size(); ++j) {
                 float dist = points[i].GetDistance(clusters[j].centroid);
                 if (points[i].minDist > dist) {
@@ -146,16 +417,17 @@ void KMean::Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) {
                     points[i].cluster = j;
                 }
             }
-            ++clusters[points[i].cluster].pointsCount;
-            clusters[points[i].cluster].sumPosition.L += points[i].position.L;
-            clusters[points[i].cluster].sumPosition.a += points[i].position.a;
-            clusters[points[i].cluster].sumPosition.b += points[i].position.b;
+            uint64_t weight = weights.empty() ? 1 : weights[i];
+            clusters[points[i].cluster].pointsCount += weight;
+            clusters[points[i].cluster].sumPosition.L += points[i].position.L * weight;
+            clusters[points[i].cluster].sumPosition.a += points[i].position.a * weight;
+            clusters[points[i].cluster].sumPosition.b += points[i].position.b * weight;
             points[i].minDist = 1000.0f;
         }
 
         for (uint32_t i = 0; i < clusters.size(); ++i) {
             if (clusters[i].pointsCount <= 0) {
-                clusters[i].centroid.position = points[rand() % points.size()].position;
+                clusters[i].centroid.position = randomPoint().position;
                 continue;
             }
             clusters[i].centroid.position.L = clusters[i].sumPosition.L / clusters[i].pointsCount;
@@ -11,22 +11,80 @@ public:
     //Quantize image in size ammount of color. store all the color in the array colors of specified size.
     //May contain really close or even duplicated color if the image doesn't have enough.
     virtual void Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) = 0;
+
+    //Same as above over pixels the caller holds, nothing is copied but the samples.
+    virtual void Quantize(const ImageView& view, Lab* colors, uint32_t size) = 0;
+
+    //Quantize several views as one image, pixels in more than one view count for each of them.
+    virtual void Quantize(const std::vector<ImageView>& views, Lab* colors, uint32_t size) = 0;
+
+    //Work on Lab16 samples instead of float ones, half the memory with integer distances.
+    //Images with a palette keep quantizing it as it is.
+    inline void SetCompactSamples(bool compact) { this->compact = compact; }
+
+    //Views are sampled every stride pixels, 8 by default. Views over a mip level are already
+    //filtered down and take every pixel, like the whole image does.
+    inline void SetViewStride(uint32_t stride) { this->viewStride = stride > 0 ? stride : 1; }
+
+protected:
+    //Every viewStride-th pixel of each view one after the other, converted in bulk.
+    LabPlanes GetViewSamples(const std::vector<ImageView>& views) const;
+
+    //Same samples in fixed point, converted a chunk at a time without float planes of all of them.
+    std::vector<Lab16> GetCompactViewSamples(const std::vector<ImageView>& views) const;
+
+    bool compact = false;
+    uint32_t viewStride = 8;
 };
 
 class MedianCut : public Quantizer {
 public:
     void Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) override;
+    void Quantize(const ImageView& view, Lab* colors, uint32_t size) override;
+    void Quantize(const std::vector<ImageView>& views, Lab* colors, uint32_t size) override;
 
 private:
-    uint32_t GetChannelMaxRange(float* start, float* end, uint32_t channelCount, float* largestChannelDiff = nullptr);
+    //Median cut over OkLab samples.
+    void QuantizeSamples(const LabPlanes& samples, Lab* colors, uint32_t size);
+
+    //Same over fixed point samples, sorted in place.
+    void QuantizeCompact(std::vector<Lab16>& samples, Lab* colors, uint32_t size);
+
+    //Median cut over the palette of an indexed image, each entry weighted by its pixel count.
+    void QuantizePalette(const std::vector<PaletteEntry>& palette, Lab* colors, uint32_t size);
 };
 
 class KMean : public Quantizer {
 public:
     void Quantize(std::shared_ptr<Image> img, Lab* colors, uint32_t size) override;
+    void Quantize(const ImageView& view, Lab* colors, uint32_t size) override;
+    void Quantize(const std::vector<ImageView>& views, Lab* colors, uint32_t size) override;
 
     inline void SetSeed(unsigned int seed) { this->seed = seed; }
 
+private:
+    struct Point {
+        Lab position = { 0.0f, 0.0f, 0.0f };
+        int cluster = -1;
+        float minDist = 1000.0;
+
+        float GetDistance(Point p) {
+            return (p.position.L - position.L)* (p.position.L - position.L) + 
+                (p.position.a - position.a) * (p.position.a - position.a) + 
+                (p.position.b - position.b) * (p.position.b - position.b);
+        }
+    };
+
+    //Cluster OkLab samples, each one a point of weight 1.
+    void QuantizeSamples(const LabPlanes& samples, Lab* colors, uint32_t size);
+
+    //Same over fixed point samples. Points are the samples themselves, assignments are never stored.
+    void QuantizeCompact(const std::vector<Lab16>& samples, Lab* colors, uint32_t size);
+
+    //Cluster the points, each one counting weights[i] times. Samples pass no weights and count once,
+    //so only palettes pay for them.
+    void QuantizePoints(std::vector<Point>& points, const std::vector<uint64_t>& weights, Lab* colors, uint32_t size);
+
 private:
     unsigned int seed = 0; 
 };
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "sampler.hpp"
+#include <algorithm>
+#include <cmath>
+
+
+RowSampler::RowSampler(SampleMode mode, uint32_t count, unsigned int seed) : mode(mode), count(count), random(seed) {}
+
+void RowSampler::Begin(int width, int height) {
+    this->width = width;
+    this->height = height;
+    samples.clear();
+    picks.clear();
+    nextPick = 0;
+
+    uint64_t total = (uint64_t)width * (uint64_t)height;
+    uint64_t wanted = std::min<uint64_t>(count, total);
+    samples.reserve((size_t)wanted);
+
+    switch (mode) {
+        case SampleMode::Stride:
+            stride = std::max<uint64_t>(total / std::max<uint64_t>(wanted, 1), 1);
+            break;
+        case SampleMode::Reservoir:
+            //Algorithm L, the first count pixels fill the reservoir then geometric jumps pick the replacements.
+            //Sized by count and not by this image, more rows can follow the height given here. (gif frames)
+            next = std::max<uint32_t>(count, 1) - 1;
+            reservoirWeight = std::exp(std::log(Uniform()) / (double)std::max<uint32_t>(count, 1));
+            SkipReservoir();
+            break;
+        case SampleMode::Stratified: {
+            //Grid with about count cells shaped like the image.
+            int rows = (int)std::lround(std::sqrt((double)wanted * height / std::max(width, 1)));
+            rows = std::clamp(rows, 1, std::max(height, 1));
+            int cols = std::clamp((int)(wanted / (uint64_t)rows), 1, std::max(width, 1));
+            picks.reserve((size_t)rows * cols);
+            for (int j = 0; j < rows; ++j) {
+                int y0 = (int)((int64_t)j * height / rows);
+                int y1 = (int)((int64_t)(j + 1) * height / rows);
+                for (int i = 0; i < cols; ++i) {
+                    int x0 = (int)((int64_t)i * width / cols);
+                    int x1 = (int)((int64_t)(i + 1) * width / cols);
+                    int y = y0 + (int)(random() % (uint32_t)std::max(y1 - y0, 1));
+                    int x = x0 + (int)(random() % (uint32_t)std::max(x1 - x0, 1));
+                    picks.emplace_back(y, x);
+                }
+            }
+            std::sort(picks.begin(), picks.end());
+            break;
+        }
+    }
+}
+
+void RowSampler::AddRow(const unsigned char* row, int y) {
+    AddPixels(row, y);
+}
+
+void RowSampler::AddRow(const uint16_t* row, int y) {
+    AddPixels(row, y);
+}
+
+void RowSampler::AddRow(const float* row, int y) {
+    AddPixels(row, y);
+}
+
+template<typename T>
+void RowSampler::AddPixels(const T* row, int y) {
+    uint64_t rowStart = (uint64_t)y * (uint64_t)width;
+    uint64_t rowEnd = rowStart + (uint64_t)width;
+
+    switch (mode) {
+        case SampleMode::Stride: {
+            uint64_t i = (rowStart + stride - 1) / stride * stride;
+            for (; i < rowEnd && samples.size() < count; i += stride)
+                samples.push_back(ToLab(&row[(i - rowStart) * 3]));
+            break;
+        }
+        case SampleMode::Reservoir: {
+            for (uint64_t i = rowStart; i < rowEnd && samples.size() < count; ++i)
+                samples.push_back(ToLab(&row[(i - rowStart) * 3]));
+            while (next < rowEnd) {
+                samples[random() % samples.size()] = ToLab(&row[(next - rowStart) * 3]);
+                reservoirWeight *= std::exp(std::log(Uniform()) / (double)samples.size());
+                SkipReservoir();
+            }
+            break;
+        }
+        case SampleMode::Stratified:
+            for (; nextPick < picks.size() && picks[nextPick].first == y; ++nextPick)
+                samples.push_back(ToLab(&row[picks[nextPick].second * 3]));
+            break;
+    }
+}
+
+Lab RowSampler::ToLab(const unsigned char* pixel) {
+    return ColorTo<Lab>(RGB8{ pixel[0], pixel[1], pixel[2] });
+}
+
+Lab RowSampler::ToLab(const uint16_t* pixel) {
+    Lab color{};
+    RGB16RowToLab(pixel, 1, 3, &color.L, &color.a, &color.b);
+    return color;
+}
+
+Lab RowSampler::ToLab(const float* pixel) {
+    Lab color{};
+    LinearRowToLab(pixel, 1, 3, &color.L, &color.a, &color.b);
+    return color;
+}
+
+double RowSampler::Uniform() {
+    return 1.0 - std::generate_canonical<double, 32>(random);
+}
+
+void RowSampler::SkipReservoir() {
+    if (reservoirWeight >= 1.0) {
+        ++next;
+        return;
+    }
+    next += (uint64_t)std::floor(std::log(Uniform()) / std::log(1.0 - reservoirWeight)) + 1;
+}
+
+void ColorHistogram::AddRow(const unsigned char* row, int width) {
+    if (cells.empty())
+        cells.resize(1 << 15);
+    for (int x = 0; x < width; ++x, row += 3) {
+        Cell& cell = cells[((row[0] >> 3) << 10) | ((row[1] >> 3) << 5) | (row[2] >> 3)];
+        ++cell.count;
+        cell.r += row[0];
+        cell.g += row[1];
+        cell.b += row[2];
+    }
+}
+
+std::vector<PaletteEntry> ColorHistogram::GetEntries() const {
+    std::vector<PaletteEntry> entries{};
+    for (const Cell& cell : cells) {
+        if (cell.count == 0)
+            continue;
+        PaletteEntry entry{};
+        entry.rgb = RGB{
+            (float)((double)cell.r / cell.count / 255.0),
+            (float)((double)cell.g / cell.count / 255.0),
+            (float)((double)cell.b / cell.count / 255.0)
+        };
+        entry.lab = ColorTo<Lab>(entry.rgb);
+        entry.count = cell.count;
+        entries.push_back(entry);
+    }
+    return entries;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <utility>
+#include "color.hpp"
+
+
+enum class SampleMode {
+    Stride, //Every n-th pixel in reading order, the same pixels the quantizers pick from a full image.
+    Reservoir, //Uniform random pixels, one pass without knowing how many will come.
+    Stratified //One random pixel in each cell of a grid laid over the image.
+};
+
+//Picks a fixed number of pixels out of rows streamed top to bottom and keeps them as OkLab,
+//so the rows can be thrown away as soon as they are seen. Only picked pixels are converted.
+//Rows are RGB, 8 or 16 bit sRGB or linear float.
+class RowSampler {
+public:
+    RowSampler() = delete;
+    RowSampler(SampleMode mode, uint32_t count, unsigned int seed);
+
+    void Begin(int width, int height);
+    void AddRow(const unsigned char* row, int y);
+    void AddRow(const uint16_t* row, int y);
+    void AddRow(const float* row, int y);
+
+    inline std::vector<Lab>& GetSamples() { return samples; }
+
+private:
+    template<typename T>
+    void AddPixels(const T* row, int y);
+
+    static Lab ToLab(const unsigned char* pixel);
+    static Lab ToLab(const uint16_t* pixel);
+    static Lab ToLab(const float* pixel);
+    //Random number in (0, 1].
+    double Uniform();
+    void SkipReservoir();
+
+private:
+    SampleMode mode;
+    uint32_t count;
+    std::mt19937 random;
+    int width = 0;
+    int height = 0;
+    uint64_t stride = 1;
+    uint64_t next = 0; //Next pixel index the reservoir takes.
+    double reservoirWeight = 0.0;
+    std::vector<std::pair<int, int>> picks{}; //Stratified (y, x) sorted by row.
+    size_t nextPick = 0;
+    std::vector<Lab> samples{};
+};
+
+//Pixel count and color sums of every 15 bit RGB cell, the same 1MB whatever the image size.
+//Cells report the mean of their pixels, only colors less than a cell apart get merged.
+class ColorHistogram {
+public:
+    void AddRow(const unsigned char* row, int width);
+
+    //Non empty cells, in cell order.
+    std::vector<PaletteEntry> GetEntries() const;
+
+private:
+    struct Cell {
+        uint64_t count = 0;
+        uint64_t r = 0;
+        uint64_t g = 0;
+        uint64_t b = 0;
+    };
+
+    std::vector<Cell> cells{};
+};
@@ -41,6 +41,17 @@
 
    Full documentation under "DOCUMENTATION" below.
 
+   LOCAL CHANGES (not part of upstream stb_image):
+      - stbi_load_options / stbi_load_ex / stbi_load_from_memory_ex: per-call load options
+      - JPEG: DCT-domain scaled decoding at 1/2, 1/4 and 1/8 (DC only)
+      - row callback output; JPEG converts and hands out one row at a time
+      - preview decoding: first Adam7 pass of PNGs, DC scans of progressive JPEGs
+      - JPEG: baseline scans with restart markers decode their intervals in parallel
+      - STBI_FAST_PNG: 64-bit inflate bit buffer with literal pair table, SSE2 unfiltering
+      - paletted PNG and GIF can be returned as palette indices plus the palette
+      - stbi_load_gif_frames_from_memory: GIF frames handed out one at a time
+      - low_memory: baseline JPEG decoded and handed out a band of MCU rows at a time
+
 
 LICENSE
 
@@ -431,12 +442,87 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
+
+// decodes an animated GIF one frame at a time instead of stacking every frame
+// like stbi_load_gif_from_memory. callback receives each composited RGBA frame,
+// its delay in ms and whether it redraws the whole canvas without transparency
+// (keyframe). returning 0 from callback stops decoding. returns the number of
+// frames handed out, 0 on error
+typedef int stbi_frame_callback(void *user, stbi_uc const *rgba, int frame, int width, int height, int delay, int keyframe);
+STBIDEF int stbi_load_gif_frames_from_memory(stbi_uc const *buffer, int len, stbi_frame_callback *callback, void *user);
 #endif
 
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
 
+////////////////////////////////////
+//
+// per-call load options, a zeroed struct gives the default behaviour
+//
+
+typedef void stbi_row_callback(void *user, stbi_uc const *row, int y, int width, int height, int channels);
+typedef void stbi_ycbcr_callback(void *user, stbi_uc const *luma, stbi_uc const *cb, stbi_uc const *cr, int y, int width, int height);
+typedef void stbi_task(void *data, int index);
+typedef void stbi_task_runner(void *user, stbi_task *task, void *data, int count);
+
+typedef struct
+{
+   int jpeg_scale;   // decode JPEGs at 1/jpeg_scale size in the DCT domain: 1, 2, 4 or 8 (DC only)
+
+   // when set, the 8-bit loaders hand every output row to row_callback, top
+   // to bottom, instead of returning the image. JPEG only ever holds one row
+   // of output; other formats are still decoded in full and then handed out.
+   // the returned pointer only signals success and must still be freed.
+   // vertical flip is ignored.
+   stbi_row_callback *row_callback;
+   void *row_user;
+
+   // stop after the first Adam7 pass of interlaced PNGs, or once every
+   // component of a progressive JPEG has its DC scan, and return that 1/8
+   // size image. other images decode normally
+   int preview;
+
+   // if set, receives how many bytes of the input the decoder went through
+   int *bytes_parsed;
+
+   // when set, run_tasks must call task(data, i) for every i in [0, count),
+   // in any order and on any threads, and return once all of them are done.
+   // baseline JPEGs with restart markers decoded from memory then split
+   // their entropy-coded data at the markers and decode the pieces this way
+   stbi_task_runner *run_tasks;
+   void *run_tasks_user;
+
+   // when palette is set, paletted PNGs and GIFs whose first frame covers the
+   // whole canvas with opaque pixels are returned as one palette index per
+   // pixel. the palette is written as RGBA to palette (room for 256 entries)
+   // and its size to *palette_size, which stays untouched for images that were
+   // expanded as usual. desired_channels and row_callback don't apply to them
+   stbi_uc *palette;
+   int *palette_size;
+
+   // with row_callback, baseline JPEGs whose components are interleaved in a
+   // single scan only keep two MCU rows of each plane and hand rows out as
+   // soon as their MCU row is decoded, so memory no longer grows with the
+   // image height. their restart intervals then decode serially
+   int low_memory;
+
+   // with row_callback, 3 component YCbCr JPEGs hand every row to
+   // ycbcr_callback instead, as the upsampled Y, Cb and Cr lines before
+   // color conversion, so the caller can convert them to whatever it keeps.
+   // every other image still goes through row_callback
+   stbi_ycbcr_callback *ycbcr_callback;
+
+   // if set, receives 1 when low_memory did decode a band at a time, and
+   // stays untouched for images that were held whole
+   int *banded;
+} stbi_load_options;
+
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *options);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, stbi_load_options const *options);
+#endif
+
 ////////////////////////////////////
 //
 // 16-bits-per-channel interface
@@ -750,7 +836,7 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || (defined(STBI_FAST_PNG) && !defined(STBI_NO_PNG))) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
@@ -761,7 +847,7 @@ static int stbi__sse2_available(void)
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
+#if (!defined(STBI_NO_JPEG) || (defined(STBI_FAST_PNG) && !defined(STBI_NO_PNG))) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -817,11 +903,18 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   stbi_load_options const *options; // may be NULL
 } stbi__context;
 
 
 static void stbi__refill_buffer(stbi__context *s);
 
+static int stbi__tell(stbi__context *s)
+{
+   return s->callback_already_read + (int) (s->img_buffer - s->img_buffer_original);
+}
+
 // initialize a memory-decode context
 static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
 {
@@ -830,6 +923,7 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
+   s->options = NULL;
 }
 
 // initialize a callback-based context
@@ -841,6 +935,7 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
+   s->options = NULL;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
 }
@@ -903,6 +998,9 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int rows_streamed; // the loader already went through options->row_callback
+   int bytes_parsed;  // set by loaders that stop before the end of their data
+   int indexed;       // one palette index per pixel, see stbi_load_options::palette
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -1265,6 +1363,9 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    if (result == NULL)
       return NULL;
 
+   if (s->options && s->options->bytes_parsed)
+      *s->options->bytes_parsed = ri.bytes_parsed ? ri.bytes_parsed : stbi__tell(s);
+
    // it is the responsibility of the loaders to make sure we get either 8 or 16 bit.
    STBI_ASSERT(ri.bits_per_channel == 8 || ri.bits_per_channel == 16);
 
@@ -1275,6 +1376,22 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
+   if (ri.indexed) {
+      if (stbi__vertically_flip_on_load)
+         stbi__vertical_flip(result, *x, *y, 1);
+      return (unsigned char *) result;
+   }
+
+   if (s->options && s->options->row_callback) {
+      if (!ri.rows_streamed) {
+         int channels = req_comp ? req_comp : *comp;
+         int row;
+         for (row = 0; row < *y; ++row)
+            s->options->row_callback(s->options->row_user, (stbi_uc *) result + (size_t) row * *x * channels, row, *x, *y, channels);
+      }
+      return (unsigned char *) result;
+   }
+
    if (stbi__vertically_flip_on_load) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
@@ -1386,6 +1503,19 @@ STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req
    return result;
 }
 
+STBIDEF stbi_uc *stbi_load_ex(char const *filename, int *x, int *y, int *comp, int req_comp, stbi_load_options const *options)
+{
+   FILE *f = stbi__fopen(filename, "rb");
+   unsigned char *result;
+   stbi__context s;
+   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
+   stbi__start_file(&s,f);
+   s.options = options;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
 STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp, int req_comp)
 {
    stbi__uint16 *result;
@@ -1433,6 +1563,14 @@ STBIDEF stbi_uc *stbi_load_from_memory(stbi_uc const *buffer, int len, int *x, i
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_from_memory_ex(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, stbi_load_options const *options)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   s.options = options;
+   return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+}
+
 STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp)
 {
    stbi__context s;
@@ -1993,6 +2131,12 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale_shift; // blocks decode to (8 >> scale_shift) pixels square
+   int stream_rows; // output a single row at a time through options->row_callback
+   int preview;     // progressive: stop once every component has its DC scan
+   int band_mcu_rows; // low_memory: the planes are rings of this many MCU rows, 0 when they hold the image
+   struct stbi__jpeg_output_s *band; // where low_memory decodes hand their rows
+   int band_started;  // low_memory: rows already went out
 
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
@@ -2000,6 +2144,8 @@ typedef struct
    stbi_uc *(*resample_row_hv_2_kernel)(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs);
 } stbi__jpeg;
 
+static int stbi__jpeg_band_rows(stbi__jpeg *z, int mcu_rows);
+
 static int stbi__build_huffman(stbi__huffman *h, int *count)
 {
    int i,j,k=0;
@@ -2523,6 +2669,67 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced-size IDCTs for scaled decoding. each output pixel is the average of
+// the (8/n)x(8/n) pixels the full IDCT would produce from the low nxn
+// coefficients, so entry [m*n+u] of the basis is C(u)/2 times the mean of
+// cos((2x+1)*u*pi/16) over the source pixels x of output m
+static const int stbi__idct_basis_4[16] =
+{
+   stbi__f2f(0.353553391f), stbi__f2f( 0.453063723f), stbi__f2f( 0.326640741f), stbi__f2f( 0.159094823f),
+   stbi__f2f(0.353553391f), stbi__f2f( 0.187665139f), stbi__f2f(-0.326640741f), stbi__f2f(-0.384088878f),
+   stbi__f2f(0.353553391f), stbi__f2f(-0.187665139f), stbi__f2f(-0.326640741f), stbi__f2f( 0.384088878f),
+   stbi__f2f(0.353553391f), stbi__f2f(-0.453063723f), stbi__f2f( 0.326640741f), stbi__f2f(-0.159094823f),
+};
+
+static const int stbi__idct_basis_2[4] =
+{
+   stbi__f2f(0.353553391f), stbi__f2f( 0.320364431f),
+   stbi__f2f(0.353553391f), stbi__f2f(-0.320364431f),
+};
+
+static stbi_inline void stbi__idct_reduced(stbi_uc *out, int out_stride, short data[64], const int *basis, int n)
+{
+   int i,j,k,val[16];
+
+   // columns: basis is scaled by 1<<12, keep 2 extra bits of precision
+   for (i=0; i < n; ++i) {
+      for (j=0; j < n; ++j) {
+         int t = 512;
+         for (k=0; k < n; ++k)
+            t += basis[j*n+k] * data[k*8+i];
+         val[j*4+i] = t >> 10;
+      }
+   }
+
+   // rows: 1<<12 from the basis plus the 1<<2 kept above, round and
+   // bias to 0..255 before the shift
+   for (j=0; j < n; ++j, out += out_stride) {
+      for (i=0; i < n; ++i) {
+         int t = (1 << 13) + (128 << 14);
+         for (k=0; k < n; ++k)
+            t += basis[i*n+k] * val[j*4+k];
+         out[i] = stbi__clamp(t >> 14);
+      }
+   }
+}
+
+static void stbi__idct_block_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_basis_4, 4);
+}
+
+static void stbi__idct_block_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   stbi__idct_reduced(out, out_stride, data, stbi__idct_basis_2, 2);
+}
+
+static void stbi__idct_block_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   // the DC term alone is the block average
+   STBI_NOTUSED(out_stride);
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2931,6 +3138,8 @@ static stbi_uc stbi__get_marker(stbi__jpeg *j)
 // of the components is specified by order[]
 #define STBI__RESTART(x)     ((x) >= 0xd0 && (x) <= 0xd7)
 
+#define STBI__MAX_RESTART_TASKS 1024
+
 // after a restart interval, stbi__jpeg_reset the entropy decoder and
 // the dc prediction
 static void stbi__jpeg_reset(stbi__jpeg *j)
@@ -2946,10 +3155,144 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+// restart intervals of a baseline scan are independent: the bit reader and
+// the dc predictions are reset at every RST marker, so each interval can be
+// decoded on its own from a context over just its bytes
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *start[STBI__MAX_RESTART_TASKS + 1]; // one past the end is the next start
+   int first_interval[STBI__MAX_RESTART_TASKS + 1];
+   int mcu_count;
+   int failed;
+} stbi__jpeg_restart_tasks;
+
+static int stbi__jpeg_decode_restart_range(stbi__jpeg *z, int mcu_start, int mcu_end)
+{
+   int mcu,k,x,y;
+   STBI_SIMD_ALIGN(short, data[64]);
+   for (mcu = mcu_start; mcu < mcu_end; ++mcu) {
+      if (mcu != mcu_start && (mcu - mcu_start) % z->restart_interval == 0) {
+         if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
+         if (!STBI__RESTART(z->marker)) return 0;
+         stbi__jpeg_reset(z);
+      }
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = mcu % w, j = mcu / w;
+         int ha = z->img_comp[n].ha;
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j*8+i*8) >> z->scale_shift), z->img_comp[n].w2, data);
+      } else {
+         int i = mcu % z->img_mcu_x, j = mcu / z->img_mcu_x;
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  int ha = z->img_comp[n].ha;
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*y2+x2) >> z->scale_shift), z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+static void stbi__jpeg_restart_task(void *data, int index)
+{
+   stbi__jpeg_restart_tasks *t = (stbi__jpeg_restart_tasks *) data;
+   stbi__context s;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   int mcu_start, mcu_end;
+   if (!z) { t->failed = 1; return; }
+
+   // the piece ends with the marker that follows it so the bit reader stops there
+   *z = *t->z;
+   stbi__start_mem(&s, t->start[index], (int) (t->start[index+1] - t->start[index]));
+   z->s = &s;
+   stbi__jpeg_reset(z);
+
+   mcu_start = t->first_interval[index] * z->restart_interval;
+   mcu_end = t->first_interval[index+1] * z->restart_interval;
+   if (mcu_end > t->mcu_count) mcu_end = t->mcu_count;
+   if (!stbi__jpeg_decode_restart_range(z, mcu_start, mcu_end))
+      t->failed = 1;
+   STBI_FREE(z);
+}
+
+// returns 1 if the scan was decoded, 0 if it should be decoded serially instead
+static int stbi__jpeg_decode_restarts_parallel(stbi__jpeg *z, int *ok)
+{
+   stbi__jpeg_restart_tasks t;
+   stbi_uc *p, *end, *marker = NULL;
+   int interval = 0, intervals, per_task, tasks = 0;
+   stbi__context *s = z->s;
+
+   *ok = 1;
+   if (!s->options || !s->options->run_tasks || z->band_mcu_rows) return 0;
+   if (z->progressive || !z->restart_interval || s->read_from_callbacks) return 0;
+
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      t.mcu_count = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else {
+      t.mcu_count = z->img_mcu_x * z->img_mcu_y;
+   }
+   intervals = (t.mcu_count + z->restart_interval - 1) / z->restart_interval;
+   if (intervals < 2) return 0;
+
+   // group intervals so every task has a reasonable amount of work
+   per_task = (256 + z->restart_interval - 1) / z->restart_interval;
+   if ((intervals + per_task - 1) / per_task > STBI__MAX_RESTART_TASKS)
+      per_task = (intervals + STBI__MAX_RESTART_TASKS - 1) / STBI__MAX_RESTART_TASKS;
+
+   // find the RST markers, and the marker that ends the scan. each piece
+   // runs up to and including the marker after it
+   p = s->img_buffer;
+   end = s->img_buffer_end;
+   while (p + 1 < end) {
+      if (p[0] != 0xff) { ++p; continue; }
+      if (p[1] == 0x00 || p[1] == 0xff) { p += (p[1] == 0x00) ? 2 : 1; continue; }
+      if (!STBI__RESTART(p[1])) { marker = p; break; }
+      ++interval;
+      if (interval % per_task == 0 && interval < intervals) {
+         t.start[tasks+1] = p + 2;
+         t.first_interval[tasks+1] = interval;
+         ++tasks;
+      }
+      p += 2;
+   }
+   // anything unexpected, let the serial decoder deal with it
+   if (!marker || interval != intervals - 1) return 0;
+
+   t.z = z;
+   t.failed = 0;
+   t.start[0] = s->img_buffer;
+   t.first_interval[0] = 0;
+   t.start[tasks+1] = marker + 2;
+   t.first_interval[tasks+1] = intervals;
+   ++tasks;
+   s->options->run_tasks(s->options->run_tasks_user, stbi__jpeg_restart_task, &t, tasks);
+
+   if (t.failed) { *ok = stbi__err("bad huffman code","Corrupt JPEG"); return 1; }
+
+   // resume right before the marker that ended the scan
+   s->img_buffer = marker;
+   stbi__jpeg_reset(z);
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
    if (!z->progressive) {
+      int ok;
+      if (stbi__jpeg_decode_restarts_parallel(z, &ok)) return ok;
       if (z->scan_n == 1) {
          int i,j;
          STBI_SIMD_ALIGN(short, data[64]);
@@ -2964,7 +3307,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
                if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*(z->band_mcu_rows ? j % z->band_mcu_rows : j)*8+i*8) >> z->scale_shift), z->img_comp[n].w2, data);
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2974,6 +3317,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->band_mcu_rows && !stbi__jpeg_band_rows(z, j+1)) return 0;
          }
          return 1;
       } else { // interleaved
@@ -2989,10 +3333,10 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
                         int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int y2 = ((z->band_mcu_rows ? j % z->band_mcu_rows : j)*z->img_comp[n].v + y)*8;
                         int ha = z->img_comp[n].ha;
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-                        z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+                        z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*y2+x2) >> z->scale_shift), z->img_comp[n].w2, data);
                      }
                   }
                }
@@ -3004,6 +3348,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->band_mcu_rows && !stbi__jpeg_band_rows(z, j+1)) return 0;
          }
          return 1;
       }
@@ -3089,7 +3434,7 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+((z->img_comp[n].w2*j*8+i*8) >> z->scale_shift), z->img_comp[n].w2, data);
             }
          }
       }
@@ -3295,7 +3640,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
 
    if (scan != STBI__SCAN_load) return 1;
 
-   if (!stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) return stbi__err("too large", "Image too large to decode");
+   // progressive scans refine the whole image, there is no band to hand out
+   if (z->progressive) z->band_mcu_rows = 0;
+   if (!z->band_mcu_rows && !stbi__mad3sizes_valid(s->img_x, s->img_y, s->img_n, 0)) return stbi__err("too large", "Image too large to decode");
 
    for (i=0; i < s->img_n; ++i) {
       if (z->img_comp[i].h > h_max) h_max = z->img_comp[i].h;
@@ -3329,8 +3676,11 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      //
+      // when decoding scaled, each 8x8 block only produces (8 >> scale_shift)
+      // pixels square, so the planes shrink accordingly
+      z->img_comp[i].w2 = (z->img_mcu_x * z->img_comp[i].h * 8) >> z->scale_shift;
+      z->img_comp[i].h2 = ((z->band_mcu_rows ? z->band_mcu_rows : z->img_mcu_y) * z->img_comp[i].v * 8) >> z->scale_shift;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
@@ -3340,10 +3690,9 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3353,6 +3702,25 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    return 1;
 }
 
+// low_memory decodes whose first scan leaves components out need the whole planes after all
+static int stbi__jpeg_unband(stbi__jpeg *z)
+{
+   int i;
+   z->band_mcu_rows = 0;
+   if (!stbi__mad3sizes_valid(z->s->img_x, z->s->img_y, z->s->img_n, 0)) return stbi__err("too large", "Image too large to decode");
+   for (i=0; i < z->s->img_n; ++i) {
+      STBI_FREE(z->img_comp[i].raw_data);
+      z->img_comp[i].h2 = (z->img_mcu_y * z->img_comp[i].v * 8) >> z->scale_shift;
+      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+      if (z->img_comp[i].raw_data == NULL) {
+         z->img_comp[i].data = NULL;
+         return stbi__err("outofmem", "Out of memory");
+      }
+   }
+   return 1;
+}
+
 // use comparisons since in some cases we handle more than one case (e.g. SOF)
 #define stbi__DNL(x)         ((x) == 0xdc)
 #define stbi__SOI(x)         ((x) == 0xd8)
@@ -3382,6 +3750,11 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
       }
    }
    z->progressive = stbi__SOF_progressive(m);
+   if (scan == STBI__SCAN_load && z->preview && z->progressive) {
+      // the DC scans alone make a complete 1/8 size image
+      z->scale_shift = 3;
+      z->idct_block_kernel = stbi__idct_block_1x1;
+   }
    if (!stbi__process_frame_header(z, scan)) return 0;
    return 1;
 }
@@ -3411,7 +3784,7 @@ static stbi_uc stbi__skip_jpeg_junk_at_end(stbi__jpeg *j)
 // decode image to YCbCr format
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
-   int m;
+   int m, dc_scanned = 0;
    for (m = 0; m < 4; m++) {
       j->img_comp[m].raw_data = NULL;
       j->img_comp[m].raw_coeff = NULL;
@@ -3421,8 +3794,20 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    m = stbi__get_marker(j);
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
+         // rows are already out, anything after the band decoded scan is ignored
+         if (j->band_started) break;
          if (!stbi__process_scan_header(j)) return 0;
+         // single component scans go block row by block row, which are MCU rows when v is 1
+         if (j->band_mcu_rows && (j->scan_n != j->s->img_n || (j->scan_n == 1 && j->img_comp[j->order[0]].v != 1)))
+            if (!stbi__jpeg_unband(j)) return 0;
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+         if (j->preview && j->progressive && j->spec_start == 0) {
+            int i;
+            for (i=0; i < j->scan_n; ++i)
+               dc_scanned |= 1 << j->order[i];
+            if (dc_scanned == (1 << j->s->img_n) - 1)
+               break;
+         }
          if (j->marker == STBI__MARKER_none ) {
          j->marker = stbi__skip_jpeg_junk_at_end(j);
             // if we reach eof without hitting a marker, stbi__get_marker() below will fail and we'll eventually return 0
@@ -3837,6 +4222,16 @@ static void stbi__setup_jpeg(stbi__jpeg *j)
    j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
    j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
 #endif
+
+   j->scale_shift = 0;
+   j->preview = j->s->options && j->s->options->preview;
+   if (j->s->options) {
+      switch (j->s->options->jpeg_scale) {
+         case 2: j->scale_shift = 1; j->idct_block_kernel = stbi__idct_block_4x4; break;
+         case 4: j->scale_shift = 2; j->idct_block_kernel = stbi__idct_block_2x2; break;
+         case 8: j->scale_shift = 3; j->idct_block_kernel = stbi__idct_block_1x1; break;
+      }
+   }
 }
 
 // clean up the temporary component buffers
@@ -3862,167 +4257,236 @@ static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
    return (stbi_uc) ((t + (t >>8)) >> 8);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+// resampling and color conversion state, kept across calls so low_memory
+// decodes can hand rows out while the entropy decoder is still running
+typedef struct stbi__jpeg_output_s
 {
-   int n, decode_n, is_rgb;
-   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+   stbi__resample res_comp[4];
+   stbi_uc *output;
+   int req_comp, n, decode_n, is_rgb;
+   stbi__uint32 row; // next output row
+} stbi__jpeg_output;
 
-   // validate req_comp
-   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+static int stbi__jpeg_output_begin(stbi__jpeg *z, stbi__jpeg_output *o)
+{
+   int k, n;
 
-   // load a jpeg image from whichever source, but leave in YCbCr format
-   if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
+   // entropy decoding is done, or runs a band ahead, from here on only the scaled size matters
+   if (z->scale_shift) {
+      int scale = 1 << z->scale_shift;
+      z->s->img_x = (z->s->img_x + scale-1) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + scale-1) >> z->scale_shift;
+      for (n=0; n < z->s->img_n; ++n)
+         z->img_comp[n].y = (z->img_comp[n].y + scale-1) >> z->scale_shift;
+   }
 
    // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
+   n = o->req_comp ? o->req_comp : z->s->img_n >= 3 ? 3 : 1;
+   o->n = n;
 
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+   o->is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
 
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
+   if (z->s->img_n == 3 && n < 3 && !o->is_rgb)
+      o->decode_n = 1;
    else
-      decode_n = z->s->img_n;
+      o->decode_n = z->s->img_n;
 
    // nothing to do if no components requested; check this now to avoid
    // accessing uninitialized coutput[0] later
-   if (decode_n <= 0) { stbi__cleanup_jpeg(z); return NULL; }
+   if (o->decode_n <= 0) return 0;
 
-   // resample and color-convert
-   {
-      int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
-
-      stbi__resample res_comp[4];
-
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
+   for (k=0; k < o->decode_n; ++k) {
+      stbi__resample *r = &o->res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
 
-      // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
-      if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-      // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
-         for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+
+   // one spare byte, the color converters write out[3] even when n is 3
+   if (z->stream_rows)
+      o->output = (stbi_uc *) stbi__malloc_mad2(n, z->s->img_x, 1);
+   else
+      o->output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+   if (!o->output) return stbi__err("outofmem", "Out of memory");
+   return 1;
+}
+
+// resample and color convert the rows whose pre-expansion lines are decoded.
+// mcu_rows is how many MCU rows low_memory decodes went through, anything
+// else has the whole planes
+static void stbi__jpeg_output_rows(stbi__jpeg *z, stbi__jpeg_output *o, int mcu_rows)
+{
+   int k, n = o->n, is_rgb = o->is_rgb;
+   unsigned int i;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+
+   for (; o->row < z->s->img_y; ++o->row) {
+      stbi_uc *out = z->stream_rows ? o->output : o->output + (size_t) n * z->s->img_x * o->row;
+      for (k=0; k < o->decode_n; ++k) {
+         stbi__resample *r = &o->res_comp[k];
+         int line1 = r->ypos < z->img_comp[k].y ? r->ypos : z->img_comp[k].y - 1;
+         if (z->band_mcu_rows && line1 >= ((mcu_rows * z->img_comp[k].v * 8) >> z->scale_shift))
+            return;
+      }
+      for (k=0; k < o->decode_n; ++k) {
+         stbi__resample *r = &o->res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(z->img_comp[k].linebuf,
+                                  y_bot ? r->line1 : r->line0,
+                                  y_bot ? r->line0 : r->line1,
+                                  r->w_lores, r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y) {
+               r->line1 += z->img_comp[k].w2;
+               // the planes of low_memory decodes are rings of band_mcu_rows MCU rows
+               if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+                  r->line1 = z->img_comp[k].data;
             }
          }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
+      }
+      if (z->stream_rows && z->s->options->ycbcr_callback && n >= 3 && z->s->img_n == 3 && !is_rgb) {
+         z->s->options->ycbcr_callback(z->s->options->row_user, coutput[0], coutput[1], coutput[2], o->row, z->s->img_x, z->s->img_y);
+         continue;
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  out[3] = 255;
                   out += n;
                }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
                for (i=0; i < z->s->img_x; ++i) {
                   stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  out[3] = 255;
                   out += n;
                }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
                for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
                   out += n;
                }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
+            }
+         } else
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               out[3] = 255; // not used if n==3
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < z->s->img_x; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
             }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < z->s->img_x; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               out[1] = 255;
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < z->s->img_x; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+            else
+               for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
          }
       }
+      if (z->stream_rows)
+         z->s->options->row_callback(z->s->options->row_user, o->output, o->row, z->s->img_x, z->s->img_y, n);
+   }
+}
+
+static int stbi__jpeg_band_rows(stbi__jpeg *z, int mcu_rows)
+{
+   if (!z->band_started && !stbi__jpeg_output_begin(z, z->band))
+      return 0;
+   z->band_started = 1;
+   stbi__jpeg_output_rows(z, z->band, mcu_rows);
+   return 1;
+}
+
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+{
+   stbi__jpeg_output o;
+   z->s->img_n = 0; // make stbi__cleanup_jpeg safe
+
+   // validate req_comp
+   if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
+
+   memset(&o, 0, sizeof(o));
+   o.req_comp = req_comp;
+   z->band = &o;
+
+   // load a jpeg image from whichever source, but leave in YCbCr format.
+   // low_memory decodes already handed out the rows of every MCU row
+   if (!stbi__decode_jpeg_image(z)) { STBI_FREE(o.output); stbi__cleanup_jpeg(z); return NULL; }
+
+   // resample and color-convert, whatever corrupt data left out comes from the planes as they are
+   if (!o.output && !stbi__jpeg_output_begin(z, &o)) {
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
-      if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
-      return output;
+      return NULL;
    }
+   if (z->band_mcu_rows && z->s->options && z->s->options->banded)
+      *z->s->options->banded = 1;
+   z->band_mcu_rows = 0;
+   stbi__jpeg_output_rows(z, &o, 0);
+
+   stbi__cleanup_jpeg(z);
+   *out_x = z->s->img_x;
+   *out_y = z->s->img_y;
+   if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
+   return o.output;
 }
 
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
@@ -4031,9 +4495,11 @@ static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int re
    stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
    if (!j) return stbi__errpuc("outofmem", "Out of memory");
    memset(j, 0, sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
    j->s = s;
    stbi__setup_jpeg(j);
+   j->stream_rows = s->options && s->options->row_callback;
+   j->band_mcu_rows = j->stream_rows && s->options->low_memory ? 2 : 0;
+   ri->rows_streamed = j->stream_rows;
    result = load_jpeg_image(j, x,y,comp,req_comp);
    STBI_FREE(j);
    return result;
@@ -4174,19 +4640,33 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
+#ifdef STBI_FAST_PNG
+// two literals whose codes fit together in STBI__ZPAIR_BITS are decoded with one lookup
+#define STBI__ZPAIR_BITS  11
+#define STBI__ZPAIR_MASK  ((1 << STBI__ZPAIR_BITS) - 1)
+typedef unsigned long long stbi__zbits;
+#else
+typedef stbi__uint32 stbi__zbits;
+#endif
+
 typedef struct
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
    int hit_zeof_once;
-   stbi__uint32 code_buffer;
+   stbi__zbits code_buffer;
 
    char *zout;
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_stop_when_full; // a full output buffer ends decoding instead of failing
+   int   z_full;
 
    stbi__zhuffman z_length, z_distance;
+#ifdef STBI_FAST_PNG
+   stbi__uint32 z_pairs[1 << STBI__ZPAIR_BITS]; // (bits << 16) | (second << 8) | first, 0 if not a literal pair
+#endif
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4202,11 +4682,11 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
 static void stbi__fill_bits(stbi__zbuf *z)
 {
    do {
-      if (z->code_buffer >= (1U << z->num_bits)) {
+      if (z->code_buffer >= ((stbi__zbits) 1 << z->num_bits)) {
         z->zbuffer = z->zbuffer_end;  /* treat this as EOF so we fail. */
         return;
       }
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
+      z->code_buffer |= (stbi__zbits) stbi__zget8(z) << z->num_bits;
       z->num_bits += 8;
    } while (z->num_bits <= 24);
 }
@@ -4215,7 +4695,7 @@ stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -4226,7 +4706,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -4260,7 +4740,7 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
          stbi__fill_bits(a);
       }
    }
-   b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
+   b = z->fast[(int) (a->code_buffer & STBI__ZFAST_MASK)];
    if (b) {
       s = b >> 9;
       a->code_buffer >>= s;
@@ -4275,6 +4755,7 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
+   if (z->z_stop_when_full) { z->z_full = 1; return 0; }
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
@@ -4306,11 +4787,176 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+#ifdef STBI_FAST_PNG
+static void stbi__zbuild_pairs(stbi__zbuf *a)
+{
+   int i;
+   for (i=0; i < (1 << STBI__ZPAIR_BITS); ++i) {
+      int b0 = a->z_length.fast[i & STBI__ZFAST_MASK], b1, s0, s1;
+      a->z_pairs[i] = 0;
+      if (!b0 || (b0 & 511) >= 256) continue;
+      s0 = b0 >> 9;
+      // the bits past STBI__ZPAIR_BITS are zero here, so only accept a second code that fits
+      b1 = a->z_length.fast[(i >> s0) & STBI__ZFAST_MASK];
+      if (!b1 || (b1 & 511) >= 256) continue;
+      s1 = b1 >> 9;
+      if (s0 + s1 > STBI__ZPAIR_BITS) continue;
+      a->z_pairs[i] = (stbi__uint32) (((s0 + s1) << 16) | ((b1 & 255) << 8) | (b0 & 255));
+   }
+}
+
+stbi_inline static stbi__zbits stbi__zload64(const stbi_uc *p)
+{
+#if defined(STBI__X86_TARGET) || defined(STBI__X64_TARGET) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__zbits v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   int i;
+   stbi__zbits v = 0;
+   for (i=7; i >= 0; --i)
+      v = (v << 8) | p[i];
+   return v;
+#endif
+}
+
+// same as stbi__zhuffman_decode, but on a bit buffer known to hold at least 16 bits
+stbi_inline static int stbi__zhuffman_decode_bits(stbi__zhuffman *z, stbi__zbits bits, int *size)
+{
+   int b,s,k;
+   b = z->fast[(int) (bits & STBI__ZFAST_MASK)];
+   if (b) {
+      *size = b >> 9;
+      return b & 511;
+   }
+   k = stbi__bit_reverse((int) (bits & 0xffff), 16);
+   for (s=STBI__ZFAST_BITS+1; ; ++s)
+      if (k < z->maxcode[s])
+         break;
+   if (s >= 16) return -1;
+   b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
+   if (b >= STBI__ZNSYMS) return -1;
+   if (z->size[b] != s) return -1;
+   *size = s;
+   return z->value[b];
+}
+
+// refill to 56..63 bits reading 8 bytes at once; bits past nbits hold the bytes that
+// follow, which the next refill ORs in again at the same place
+#define STBI__ZREFILL() \
+   do { \
+      bits |= stbi__zload64(in) << nbits; \
+      in += (63 - nbits) >> 3; \
+      nbits |= 56; \
+   } while (0)
+
+// inner loop for when at least 16 input bytes and a full match of output room are left.
+// a refill covers two literal pairs, or a length/distance pair with all its extra bits.
+// returns 1 at the end of the block, 0 on error, -1 when the careful loop has to go on
+static int stbi__parse_huffman_fast(stbi__zbuf *a, char **pzout)
+{
+   char *zout = *pzout;
+   stbi_uc *in = a->zbuffer;
+   stbi__zbits bits = a->code_buffer;
+   int nbits = a->num_bits;
+   int result = -1;
+
+   while (a->zbuffer_end - in >= 16 && a->zout_end - zout >= 258 + 8) {
+      stbi__uint32 pair;
+      stbi_uc *p;
+      int z,s,len,dist;
+      STBI__ZREFILL();
+      pair = a->z_pairs[(int) (bits & STBI__ZPAIR_MASK)];
+      if (pair) {
+         zout[0] = (char) (pair & 255);
+         zout[1] = (char) ((pair >> 8) & 255);
+         zout += 2;
+         s = (int) (pair >> 16);
+         bits >>= s;
+         nbits -= s;
+         pair = a->z_pairs[(int) (bits & STBI__ZPAIR_MASK)];
+         if (pair) {
+            zout[0] = (char) (pair & 255);
+            zout[1] = (char) ((pair >> 8) & 255);
+            zout += 2;
+            s = (int) (pair >> 16);
+            bits >>= s;
+            nbits -= s;
+            continue;
+         }
+      }
+      z = stbi__zhuffman_decode_bits(&a->z_length, bits, &s);
+      if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
+      bits >>= s;
+      nbits -= s;
+      if (z < 256) {
+         *zout++ = (char) z;
+         continue;
+      }
+      if (z == 256) {
+         result = 1;
+         break;
+      }
+      if (z >= 286) return stbi__err("bad huffman code","Corrupt PNG");
+      STBI__ZREFILL();
+      z -= 257;
+      len = stbi__zlength_base[z];
+      s = stbi__zlength_extra[z];
+      len += (int) (bits & ((1 << s) - 1));
+      bits >>= s;
+      nbits -= s;
+      z = stbi__zhuffman_decode_bits(&a->z_distance, bits, &s);
+      if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
+      bits >>= s;
+      nbits -= s;
+      dist = stbi__zdist_base[z];
+      s = stbi__zdist_extra[z];
+      dist += (int) (bits & ((1 << s) - 1));
+      bits >>= s;
+      nbits -= s;
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+      p = (stbi_uc *) (zout - dist);
+      if (dist == 1) {
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8) {
+         // 8 byte chunks never read what they write; the tail past len is overwritten later
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else {
+         do *zout++ = *p++; while (--len);
+      }
+   }
+
+   a->zbuffer = in;
+   a->code_buffer = bits & (((stbi__zbits) 1 << nbits) - 1);
+   a->num_bits = nbits;
+   *pzout = zout;
+   return result;
+}
+#endif
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+#ifdef STBI_FAST_PNG
+      if (a->zbuffer_end - a->zbuffer >= 16 && a->zout_end - zout >= 258 + 8) {
+         int r = stbi__parse_huffman_fast(a, &zout);
+         if (r >= 0) {
+            a->zout = zout;
+            return r;
+         }
+         continue;
+      }
+#endif
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4414,12 +5060,21 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
    if (a->num_bits < 0) return stbi__err("zlib corrupt","Corrupt PNG");
+#ifdef STBI_FAST_PNG
+   // the 64-bit buffer can hold bytes past the header, hand them back
+   if (a->num_bits > 0) {
+      if (!a->hit_zeof_once)
+         a->zbuffer -= a->num_bits >> 3;
+      a->code_buffer = 0;
+      a->num_bits = 0;
+   }
+#endif
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
@@ -4427,6 +5082,15 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
    if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
+   if (a->zout + len > a->zout_end && a->z_stop_when_full) {
+      // only the start of this block is wanted
+      len = (int) (a->zout_end - a->zout);
+      memcpy(a->zout, a->zbuffer, len);
+      a->zbuffer += len;
+      a->zout += len;
+      a->z_full = 1;
+      return 0;
+   }
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
    memcpy(a->zout, a->zbuffer, len);
@@ -4501,6 +5165,9 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
+#ifdef STBI_FAST_PNG
+         stbi__zbuild_pairs(a);
+#endif
          if (!stbi__parse_huffman_block(a)) return 0;
       }
    } while (!final);
@@ -4513,10 +5180,30 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_stop_when_full = 0;
+   a->z_full = 0;
 
    return stbi__parse_zlib(a, parse_header);
 }
 
+// inflate only as much as fits in obuf. returns the number of bytes written,
+// or -1 on error; *consumed receives how much of the input was used
+static int stbi__zlib_decode_prefix(char *obuf, int olen, stbi_uc const *ibuffer, int ilen, int parse_header, int *consumed)
+{
+   stbi__zbuf a;
+   a.zbuffer = (stbi_uc *) ibuffer;
+   a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
+   a.zout_start = a.zout = obuf;
+   a.zout_end = obuf + olen;
+   a.z_expandable = 0;
+   a.z_stop_when_full = 1;
+   a.z_full = 0;
+   if (!stbi__parse_zlib(&a, parse_header) && !a.z_full)
+      return -1;
+   *consumed = (int) (a.zbuffer - (stbi_uc *) ibuffer);
+   return (int) (a.zout - a.zout_start);
+}
+
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen)
 {
    stbi__zbuf a;
@@ -4632,6 +5319,8 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int bytes_parsed; // preview only, see stbi_load_options
+   int indexed;      // out holds palette indices, see stbi_load_options
 } stbi__png;
 
 
@@ -4667,6 +5356,107 @@ static int stbi__paeth(int a, int b, int c)
    return t1;
 }
 
+#if defined(STBI_FAST_PNG) && defined(STBI_SSE2)
+// 3 byte pixels are assembled by hand, going through a partially written int stalls store forwarding
+stbi_inline static __m128i stbi__png_load_px(const stbi_uc *p, int n)
+{
+   stbi__uint32 v;
+   if (n == 4)
+      memcpy(&v, p, 4);
+   else
+      v = p[0] | (p[1] << 8) | ((stbi__uint32) p[2] << 16);
+   return _mm_cvtsi32_si128((int) v);
+}
+
+stbi_inline static void stbi__png_store_px(stbi_uc *p, __m128i v, int n)
+{
+   stbi__uint32 t = (stbi__uint32) _mm_cvtsi128_si32(v);
+   if (n == 4) {
+      memcpy(p, &t, 4);
+   } else {
+      p[0] = (stbi_uc) t;
+      p[1] = (stbi_uc) (t >> 8);
+      p[2] = (stbi_uc) (t >> 16);
+   }
+}
+
+// sub, avg and paeth depend on the pixel to the left, so they go one 3 or 4 byte pixel
+// at a time with all channels in one register. inlined with a constant filter_bytes
+stbi_inline static int stbi__png_unfilter_sse2_px(int filter, stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int nk, int filter_bytes)
+{
+   __m128i zero = _mm_setzero_si128();
+   int k;
+
+   if (filter == STBI__F_sub) {
+      __m128i a = zero;
+      for (k = 0; k < nk; k += filter_bytes) {
+         a = _mm_add_epi8(a, stbi__png_load_px(raw + k, filter_bytes));
+         stbi__png_store_px(cur + k, a, filter_bytes);
+      }
+      return 1;
+   }
+
+   if (filter == STBI__F_avg) {
+      __m128i a = zero, one = _mm_set1_epi8(1);
+      for (k = 0; k < nk; k += filter_bytes) {
+         __m128i b = stbi__png_load_px(prior + k, filter_bytes);
+         // avg_epu8 rounds up, take the carry back off to get (a+b)>>1
+         __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+         a = _mm_add_epi8(stbi__png_load_px(raw + k, filter_bytes), avg);
+         stbi__png_store_px(cur + k, a, filter_bytes);
+      }
+      return 1;
+   }
+
+   if (filter == STBI__F_paeth) {
+      // a, b and c widened to 16 bits; picks the same predictor as the PNG spec
+      __m128i a = zero, c = zero;
+      for (k = 0; k < nk; k += filter_bytes) {
+         __m128i b = _mm_unpacklo_epi8(stbi__png_load_px(prior + k, filter_bytes), zero);
+         __m128i pa = _mm_sub_epi16(b, c);
+         __m128i pb = _mm_sub_epi16(a, c);
+         __m128i pc = _mm_add_epi16(pa, pb);
+         __m128i smallest, use_a, use_b, pred, x;
+         pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+         pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+         pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+         smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+         use_a = _mm_cmpeq_epi16(pa, smallest);
+         use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(pb, smallest));
+         pred = _mm_or_si128(_mm_andnot_si128(_mm_or_si128(use_a, use_b), c),
+                _mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)));
+         x = _mm_add_epi8(stbi__png_load_px(raw + k, filter_bytes), _mm_packus_epi16(pred, pred));
+         stbi__png_store_px(cur + k, x, filter_bytes);
+         a = _mm_unpacklo_epi8(x, zero);
+         c = b;
+      }
+      return 1;
+   }
+
+   return 0;
+}
+
+// unfilter one row with SSE2, up has no dependency between bytes and goes 16 at a time.
+// returns 0 for rows left to the scalar code
+static int stbi__png_unfilter_sse2(int filter, stbi_uc *cur, const stbi_uc *prior, const stbi_uc *raw, int nk, int filter_bytes)
+{
+   if (filter == STBI__F_up) {
+      int k;
+      for (k = 0; k + 16 <= nk; k += 16) {
+         __m128i x = _mm_loadu_si128((const __m128i *) (raw + k));
+         __m128i b = _mm_loadu_si128((const __m128i *) (prior + k));
+         _mm_storeu_si128((__m128i *) (cur + k), _mm_add_epi8(x, b));
+      }
+      for (; k < nk; ++k)
+         cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+      return 1;
+   }
+   if (filter_bytes == 4) return stbi__png_unfilter_sse2_px(filter, cur, prior, raw, nk, 4);
+   if (filter_bytes == 3) return stbi__png_unfilter_sse2_px(filter, cur, prior, raw, nk, 3);
+   return 0;
+}
+#endif
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // adds an extra all-255 alpha channel
@@ -4752,6 +5542,9 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
       if (j == 0) filter = first_row_filter[filter];
 
       // perform actual filtering
+#if defined(STBI_FAST_PNG) && defined(STBI_SSE2)
+      if (!stbi__sse2_available() || !stbi__png_unfilter_sse2(filter, cur, prior, raw, nk, filter_bytes))
+#endif
       switch (filter) {
       case STBI__F_none:
          memcpy(cur, raw, nk);
@@ -5081,12 +5874,14 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, idata_pos=0;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->bytes_parsed = 0;
+   z->indexed = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5191,6 +5986,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
+            if (ioff == 0) idata_pos = stbi__tell(s);
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
             ioff += c.length;
             break;
@@ -5201,11 +5997,27 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
-            if (z->expanded == NULL) return 0; // zlib should set error
+            if (interlace && s->options && s->options->preview) {
+               // Adam7 pass 1 comes first in the stream and is every 8th pixel
+               // of every 8th row: inflate just that and decode it as the image
+               int produced, consumed;
+               s->img_x = (s->img_x + 7) >> 3;
+               s->img_y = (s->img_y + 7) >> 3;
+               interlace = 0;
+               raw_len = (((s->img_n * s->img_x * z->depth) + 7) >> 3) * s->img_y + s->img_y;
+               // a match may stop short of the end, leave room for the longest one
+               z->expanded = (stbi_uc *) stbi__malloc(raw_len + 258);
+               if (z->expanded == NULL) return stbi__err("outofmem", "Out of memory");
+               produced = stbi__zlib_decode_prefix((char *) z->expanded, raw_len + 258, z->idata, ioff, !is_iphone, &consumed);
+               if (produced < (int) raw_len) return stbi__err("outofdata","Corrupt PNG");
+               z->bytes_parsed = idata_pos + consumed;
+            } else {
+               // initial guess for decoded data size to avoid unnecessary reallocs
+               bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
+               raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+               z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+               if (z->expanded == NULL) return 0; // zlib should set error
+            }
             STBI_FREE(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
@@ -5221,7 +6033,14 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             }
             if (is_iphone && stbi__de_iphone_flag && s->img_out_n > 2)
                stbi__de_iphone(z);
-            if (pal_img_n) {
+            if (pal_img_n && s->options && s->options->palette) {
+               // keep the indices, the caller expands or counts them
+               s->img_n = pal_img_n;
+               s->img_out_n = 1;
+               memcpy(s->options->palette, palette, pal_len * 4);
+               if (s->options->palette_size) *s->options->palette_size = (int) pal_len;
+               z->indexed = 1;
+            } else if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
@@ -5273,7 +6092,9 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
       result = p->out;
       p->out = NULL;
-      if (req_comp && req_comp != p->s->img_out_n) {
+      ri->bytes_parsed = p->bytes_parsed;
+      ri->indexed = p->indexed;
+      if (req_comp && req_comp != p->s->img_out_n && !p->indexed) {
          if (ri->bits_per_channel == 8)
             result = stbi__convert_format((unsigned char *) result, p->s->img_out_n, req_comp, p->s->img_x, p->s->img_y);
          else
@@ -6575,6 +7396,10 @@ typedef struct
    int cur_x, cur_y;
    int line_size;
    int delay;
+   int keyframe;                 // the last frame covered the canvas without transparency
+   int want_indices;             // record the palette index of every pixel of the first frame
+   stbi_uc *indices;
+   int indexed_count;            // opaque pixels written to indices
 } stbi__gif;
 
 static int stbi__gif_test_raw(stbi__context *s)
@@ -6673,6 +7498,10 @@ static void stbi__out_gif_code(stbi__gif *g, stbi__uint16 code)
       p[1] = c[1];
       p[2] = c[0];
       p[3] = c[3];
+      if (g->indices) {
+         g->indices[idx / 4] = g->codes[code].suffix;
+         ++g->indexed_count;
+      }
    }
    g->cur_x += 4;
 
@@ -6795,6 +7624,10 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
       g->history = (stbi_uc *) stbi__malloc(pcount);
       if (!g->out || !g->background || !g->history)
          return stbi__errpuc("outofmem", "Out of memory");
+      if (g->want_indices) {
+         g->indices = (stbi_uc *) stbi__malloc(pcount);
+         if (!g->indices) return stbi__errpuc("outofmem", "Out of memory");
+      }
 
       // image is treated as "transparent" at the start - ie, nothing overwrites the current background;
       // background colour is only used for pixels that are not rendered first frame, after that "background"
@@ -6869,6 +7702,8 @@ static stbi_uc *stbi__gif_load_next(stbi__context *s, stbi__gif *g, int *comp, i
             if (w == 0)
                g->cur_y = g->max_y;
 
+            g->keyframe = x == 0 && y == 0 && w == g->w && h == g->h && !(g->eflags & 0x01);
+
             g->lflags = stbi__get8(s);
 
             if (g->lflags & 0x40) {
@@ -7045,23 +7880,89 @@ static void *stbi__load_gif_main(stbi__context *s, int **delays, int *x, int *y,
    }
 }
 
+STBIDEF int stbi_load_gif_frames_from_memory(stbi_uc const *buffer, int len, stbi_frame_callback *callback, void *user)
+{
+   stbi__context s;
+   stbi__gif g;
+   stbi_uc *back[2] = { 0, 0 }; // composited frames kept for "restore to previous" disposal
+   int frames = 0, failed = 0;
+   stbi__start_mem(&s,buffer,len);
+   if (!stbi__gif_test(&s)) return stbi__err("not GIF", "Image was not as a gif type.");
+
+   memset(&g, 0, sizeof(g));
+   for (;;) {
+      // frame n disposes back to frame n-2, which sits in back[n & 1]
+      stbi_uc *u = stbi__gif_load_next(&s, &g, NULL, 4, frames >= 2 ? back[frames & 1] : 0);
+      size_t size;
+      if (u == (stbi_uc *) &s) break;  // end of animated gif marker
+      if (!u) { failed = 1; break; }
+      size = (size_t) g.w * g.h * 4;
+      if (!back[frames & 1]) {
+         back[frames & 1] = (stbi_uc *) stbi__malloc(size);
+         if (!back[frames & 1]) {
+            stbi__err("outofmem", "Out of memory");
+            failed = 1;
+            break;
+         }
+      }
+      memcpy(back[frames & 1], u, size);
+      ++frames;
+      if (!callback(user, u, frames - 1, g.w, g.h, g.delay, g.keyframe)) break;
+   }
+
+   STBI_FREE(back[0]);
+   STBI_FREE(back[1]);
+   STBI_FREE(g.out);
+   STBI_FREE(g.history);
+   STBI_FREE(g.background);
+   return failed && !frames ? 0 : frames;
+}
+
+
+// when the frame drew every pixel opaque, swap the RGBA image for its indices
+static stbi_uc *stbi__gif_take_indices(stbi__context *s, stbi__gif *g, stbi_uc *u)
+{
+   int i, n;
+   if (!g->indices || g->indexed_count != g->w * g->h)
+      return NULL;
+   n = (g->lflags & 0x80) ? 2 << (g->lflags & 7) : 2 << (g->flags & 7);
+   for (i=0; i < n; ++i) {
+      s->options->palette[i*4+0] = g->color_table[i*4+2];
+      s->options->palette[i*4+1] = g->color_table[i*4+1];
+      s->options->palette[i*4+2] = g->color_table[i*4+0];
+      s->options->palette[i*4+3] = 255;
+   }
+   if (s->options->palette_size) *s->options->palette_size = n;
+   STBI_FREE(u);
+   u = g->indices;
+   g->indices = NULL;
+   return u;
+}
+
 static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    stbi_uc *u = 0;
    stbi__gif g;
    memset(&g, 0, sizeof(g));
-   STBI_NOTUSED(ri);
+
+   g.want_indices = s->options && s->options->palette;
 
    u = stbi__gif_load_next(s, &g, comp, req_comp, 0);
    if (u == (stbi_uc *) s) u = 0;  // end of animated gif marker
    if (u) {
+      stbi_uc *indices;
       *x = g.w;
       *y = g.h;
 
-      // moved conversion to after successful load so that the same
-      // can be done for multiple frames.
-      if (req_comp && req_comp != 4)
+      indices = stbi__gif_take_indices(s, &g, u);
+      if (indices) {
+         ri->indexed = 1;
+         u = indices;
+      } else if (req_comp && req_comp != 4) {
+         // moved conversion to after successful load so that the same
+         // can be done for multiple frames.
          u = stbi__convert_format(u, 4, req_comp, g.w, g.h);
+      }
    } else if (g.out) {
       // if there was an error and we allocated an image buffer, free it!
       STBI_FREE(g.out);
@@ -7070,6 +7971,7 @@ static void *stbi__gif_load(stbi__context *s, int *x, int *y, int *comp, int req
    // free buffers needed for multiple frame loading;
    STBI_FREE(g.history);
    STBI_FREE(g.background);
+   STBI_FREE(g.indices);
 
    return u;
 }
@@ -0,0 +1,159 @@
+#include "thumbnail.hpp"
+#include "input.hpp"
+#include "cache.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <sys/stat.h>
+
+
+//MD5 of a short string, thumbnails are named after the one of their URI.
+static std::string MD5(const std::string& text) {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+    };
+    static const int S[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+    //Padding, a one bit, zeros up to 56 bytes of the last block and the length in bits.
+    std::string message = text;
+    uint64_t bits = (uint64_t)text.size() * 8;
+    message += (char)0x80;
+    while (message.size() % 64 != 56)
+        message += (char)0;
+    for (int i = 0; i < 8; ++i)
+        message += (char)(bits >> (i * 8));
+
+    uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    for (size_t block = 0; block < message.size(); block += 64) {
+        uint32_t m[16];
+        for (int i = 0; i < 16; ++i) {
+            const unsigned char* p = (const unsigned char*)&message[block + i * 4];
+            m[i] = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t f;
+            int g;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                g = i;
+            } else if (i < 32) {
+                f = (d & b) | (~d & c);
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = b ^ c ^ d;
+                g = (3 * i + 5) % 16;
+            } else {
+                f = c ^ (b | ~d);
+                g = (7 * i) % 16;
+            }
+            uint32_t rotated = a + f + K[i] + m[g];
+            int shift = S[(i / 16) * 4 + i % 4];
+            a = d;
+            d = c;
+            c = b;
+            b += (rotated << shift) | (rotated >> (32 - shift));
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+
+    static const char* digits = "0123456789abcdef";
+    std::string hex{};
+    for (uint32_t word : h) {
+        for (int i = 0; i < 4; ++i) {
+            unsigned char byte = (unsigned char)(word >> (i * 8));
+            hex += digits[byte >> 4];
+            hex += digits[byte & 15];
+        }
+    }
+    return hex;
+}
+
+//file:// URI of an absolute path, escaped the way GLib does it since that is what most thumbnailers use.
+static std::string FileURI(const char* path) {
+    static const char* digits = "0123456789ABCDEF";
+    std::string uri = "file://";
+    for (const unsigned char* p = (const unsigned char*)path; *p; ++p) {
+        unsigned char c = *p;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("!$&'()*+,-./:=@_~", c)) {
+            uri += (char)c;
+        } else {
+            uri += '%';
+            uri += digits[c >> 4];
+            uri += digits[c & 15];
+        }
+    }
+    return uri;
+}
+
+static uint32_t ReadBE32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+//A thumbnail is valid when it is a png whose Thumb::URI and Thumb::MTime tEXt chunks match the file.
+static bool IsValidThumbnail(const std::string& path, const std::string& uri, const std::string& mtime) {
+    InputFile file{ path.c_str() };
+    if (!file.IsValid() || file.GetSize() < 8 || memcmp(file.GetData(), "\x89PNG\r\n\x1a\n", 8) != 0)
+        return false;
+
+    bool uriMatches = false;
+    bool mtimeMatches = false;
+    const unsigned char* p = file.GetData() + 8;
+    const unsigned char* end = file.GetData() + file.GetSize();
+    while (end - p >= 12) {
+        uint32_t length = ReadBE32(p);
+        const unsigned char* type = p + 4;
+        const unsigned char* data = p + 8;
+        if (length > (size_t)(end - data) - 4 || memcmp(type, "IEND", 4) == 0)
+            break;
+
+        if (memcmp(type, "tEXt", 4) == 0) {
+            const unsigned char* separator = (const unsigned char*)memchr(data, 0, length);
+            if (separator) {
+                std::string key{ (const char*)data, (size_t)(separator - data) };
+                std::string value{ (const char*)separator + 1, (size_t)(data + length - separator - 1) };
+                if (key == "Thumb::URI")
+                    uriMatches = value == uri;
+                else if (key == "Thumb::MTime")
+                    mtimeMatches = value == mtime;
+            }
+        }
+        p = data + length + 4;
+    }
+    return uriMatches && mtimeMatches;
+}
+
+std::string FindThumbnail(const char* filename) {
+    char path[PATH_MAX];
+    struct stat info;
+    if (strcmp(filename, "-") == 0 || !realpath(filename, path) || stat(path, &info) != 0 || !S_ISREG(info.st_mode))
+        return std::string{};
+
+    std::string directory = GetCacheDirectory();
+    if (directory.empty())
+        return std::string{};
+    directory += "/thumbnails/";
+
+    std::string uri = FileURI(path);
+    std::string name = MD5(uri) + ".png";
+    std::string mtime = std::to_string((long long)info.st_mtime);
+    for (const char* size : { "x-large/", "large/" }) {
+        std::string thumbnail = directory + size + name;
+        if (IsValidThumbnail(thumbnail, uri, mtime))
+            return thumbnail;
+    }
+    return std::string{};
+}
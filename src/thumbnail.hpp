@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+
+//Path of a freedesktop thumbnail of filename that is still valid, its Thumb::URI and Thumb::MTime
+//matching the file. Largest first out of x-large and large, empty when there is none.
+std::string FindThumbnail(const char* filename);